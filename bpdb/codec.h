@@ -67,6 +67,73 @@ inline page_id_t decode_page_id(char **ptr)
     return decode64(ptr);
 }
 
+// 大端整数按字节比较的顺序就是它的数值顺序
+inline uint64_t decode_be64(const char *p)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < 8; i++) {
+        n = (n << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return n;
+}
+
+// LEB128: 每个字节的低7位存放数据，最高位表示后面还有没有字节
+inline void encode_varint(std::string& buf, uint64_t n)
+{
+    while (n >= 0x80) {
+        buf.push_back(static_cast<char>(n | 0x80));
+        n >>= 7;
+    }
+    buf.push_back(static_cast<char>(n));
+}
+
+inline uint64_t decode_varint(char **ptr)
+{
+    uint64_t n = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t c = *reinterpret_cast<uint8_t*>(*ptr);
+        *ptr += 1;
+        n |= static_cast<uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) break;
+    }
+    return n;
+}
+
+inline size_t varint_size(uint64_t n)
+{
+    size_t len = 1;
+    while (n >= 0x80) {
+        n >>= 7;
+        len++;
+    }
+    return len;
+}
+
+// value-header: varint(value-len << 2 | in-vlog << 1 | has-trx-id) [varint(trx-id)]
+// 不在事务中写入的value的trx-id为0，这时就省略它
+inline void encode_value_header(std::string& buf, uint32_t len, bool in_vlog, trx_id_t trx_id)
+{
+    encode_varint(buf, (uint64_t)len << 2 | in_vlog << 1 | (trx_id > 0));
+    if (trx_id > 0) encode_varint(buf, trx_id);
+}
+
+// 返回value-len
+inline uint32_t decode_value_header(char **ptr, trx_id_t *trx_id, bool *in_vlog)
+{
+    uint64_t n = decode_varint(ptr);
+    *trx_id = (n & 1) ? decode_varint(ptr) : 0;
+    *in_vlog = n & 2;
+    return n >> 2;
+}
+
+// in-vlog位不影响varint的长度
+inline size_t value_header_size(uint32_t len, trx_id_t trx_id)
+{
+    size_t n = varint_size((uint64_t)len << 2);
+    if (trx_id > 0) n += varint_size(trx_id);
+    return n;
+}
+
 }
 
 #endif // __BPDB_CODEC_H
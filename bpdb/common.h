@@ -5,8 +5,12 @@
 #include <vector>
 #include <mutex>
 #include <shared_mutex>
+#include <atomic>
+#include <string_view>
+#include <algorithm>
 
 #include <limits.h>
+#include <string.h>
 
 namespace bpdb {
 
@@ -17,15 +21,24 @@ typedef uint64_t trx_id_t;
 
 struct value_t {
     ~value_t() { delete val; }
+    // 在叶节点中占用的字节数
+    size_t page_used() const;
+    // 是否保存在value-log中，见options::value_log
+    bool in_vlog() const;
     page_id_t over_page_id = 0;
     uint16_t page_off = 0;
+    // value在value-log中的位置，vlog_file为0表示还未写入
+    uint32_t vlog_file = 0;
+    uint64_t vlog_off = 0;
     uint32_t reallen;
     std::string *val;
     trx_id_t trx_id = 0;
 };
 
 struct header_t {
-    int8_t magic = 0x1a;
+    // 磁盘格式不兼容地改变时要换一个magic，旧格式的数据文件会在load_header()时被拒绝
+    // 0x1a: 旧的节点格式，0x1b: slotted-page、公共前缀和紧凑的value头部
+    int8_t magic = 0x1b;
     size_t page_size = 1024 * 16;
     size_t key_nums = 0;
     page_id_t root_id = 0;
@@ -34,6 +47,10 @@ struct header_t {
     size_t free_pages = 0;
     page_id_t over_page_list_head = 0;
     size_t over_pages = 0;
+    // 每次check-point加1，它同时写入freemap和journal，以检查它们是否是同一次check-point写入的
+    uint64_t check_point_seq = 0;
+    // 是否以options::int_keys创建，打开时必须与之一致
+    int8_t int_keys = 0;
 };
 
 struct limit_t {
@@ -43,18 +60,33 @@ struct limit_t {
     const size_t type_field = 1;
     const size_t key_nums_field = 2;
     const size_t key_len_field = 1;
-    const size_t value_len_field = 4;
+    // slotted-page中每个记录的slot(页内偏移)
+    const size_t slot_field = 2;
+    // 叶节点中所有key的公共前缀只保存一次
+    const size_t prefix_len_field = 1;
     // 如果一个value的长度超过了over_value，那么超出的部分将被存放到溢出页
     // 由header.page_size决定
     size_t over_value;
+    // 超过over_value的value写入value-log而不是溢出页
+    bool value_log = false;
+    // 所有key都是8字节的大端整数，见options::int_keys
+    bool int_keys = false;
+    const size_t int_key_len = 8;
 };
 
 extern struct limit_t limit;
 
+inline size_t common_prefix(const key_t& l, const key_t& r)
+{
+    size_t n = std::min(l.size(), r.size()), i = 0;
+    while (i < n && l[i] == r[i]) i++;
+    return i;
+}
+
 struct node {
     node(bool leaf) : leaf(leaf)
     {
-        page_used = limit.type_field + limit.key_nums_field;
+        page_used = limit.type_field + limit.key_nums_field + limit.prefix_len_field;
         if (leaf) page_used += sizeof(page_id_t) * 2; // left and right
     }
     ~node()
@@ -66,11 +98,65 @@ struct node {
         }
     }
 
+    // 被pin住的节点不会被淘汰出缓存
+    void pin() { pins++; }
+    void unpin() { pins--; }
+
     void lock_shared() { latch.lock_shared(); }
     void unlock_shared() { latch.unlock_shared(); }
-    void lock() { latch.lock(); }
+    // 持有写锁就意味着要修改节点了，所以packed的节点需要先解码
+    void lock() { latch.lock(); if (packed) unpack(); }
     void unlock() { latch.unlock(); }
 
+    // 从磁盘加载的节点会先保持页的原始格式(packed)，读操作直接在page上查找，
+    // 不必为每个key和value分配内存，只有第一次被修改时才会解码到keys/values/childs
+    void unpack();
+    int size() const
+    {
+        if (!packed) return keys.size();
+        uint16_t n;
+        memcpy(&n, page.data() + limit.type_field, sizeof(n));
+        return n;
+    }
+    // 节点的公共前缀，它紧跟在left和right之后
+    std::string_view packed_prefix() const
+    {
+        size_t off = limit.type_field + limit.key_nums_field;
+        if (leaf) off += sizeof(page_id_t) * 2;
+        const char *p = page.data() + off;
+        return std::string_view(p + limit.prefix_len_field, static_cast<uint8_t>(*p));
+    }
+    // 第i个记录在page中的位置，[key-len][key-suffix][value or child-page-id]
+    const char *record(int i) const
+    {
+        auto prefix = packed_prefix();
+        const char *slots = prefix.data() + prefix.size();
+        uint16_t off;
+        memcpy(&off, slots + i * limit.slot_field, sizeof(off));
+        return page.data() + off;
+    }
+    std::string_view packed_suffix(int i) const
+    {
+        const char *p = record(i);
+        return std::string_view(p + limit.key_len_field, static_cast<uint8_t>(*p));
+    }
+    // 拼接出完整的key，key的容量会被复用
+    void packed_key(int i, key_t& key) const
+    {
+        auto prefix = packed_prefix();
+        auto suffix = packed_suffix(i);
+        key.assign(prefix.data(), prefix.size());
+        key.append(suffix.data(), suffix.size());
+    }
+    page_id_t packed_child(int i) const
+    {
+        const char *p = record(i);
+        page_id_t child;
+        memcpy(&child, p + limit.key_len_field + static_cast<uint8_t>(*p), sizeof(child));
+        return child;
+    }
+    page_id_t child(int i) const { return packed ? packed_child(i) : childs[i]; }
+
     void resize(int n)
     {
         keys.resize(n);
@@ -104,6 +190,10 @@ struct node {
         copy(i, this, j);
     }
     void update(bool dirty = true);
+    size_t key_prefix() const;
+    void update_ikeys();
+    void check_int_key(const key_t& key);
+    void mark_dirty();
 
     void free()
     {
@@ -113,12 +203,28 @@ struct node {
 
     bool leaf;
     bool dirty = false;
-    bool maybe_using = false;
+    // 节点最近一次由干净变脏的序号，page-cleaner据此先写回最早变脏的页
+    uint64_t dirtied = 0;
     bool deleted = false;
+    bool packed = false;
+    // 叶节点中所有key的公共前缀的长度，由update()计算，索引节点总是0
+    uint8_t prefix = 0;
+    // 叶节点中最近一次插入的key的位置，只保存在内存中，见DB::get_split_type()
+    // 其他修改都可能让它失效，所以update()总是把它重置为-1，插入时再重新设置
+    int last_insert = -1;
+    std::atomic_int pins = 0;
     std::vector<key_t> keys;
     std::vector<page_id_t> childs;
     std::vector<value_t*> values;
+    // limit.int_keys时keys对应的整数，它们连续存放以便用SIMD查找，由update()维护
+    std::vector<uint64_t> ikeys;
+    // packed时保存的原始页
+    std::string page;
     size_t page_used;
+    // 节点在内存中实际占用的字节数，由update()计算，用于按字节限制缓存大小
+    std::atomic_size_t mem_used = 0;
+    // 由translation_table在加入缓存时设置
+    page_id_t page_id = 0;
     page_id_t left = 0, right = 0;
     // 保护节点本身以及对应的磁盘页
     std::shared_mutex latch;
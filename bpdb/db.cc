@@ -1,8 +1,15 @@
 #include <unordered_set>
+#include <thread>
 
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <stdarg.h>
+#include <math.h>
 
 #include "db.h"
+#include "codec.h"
+#include "loader.h"
+#include "util.h"
 
 namespace bpdb {
 
@@ -22,15 +29,22 @@ void panic(const char *fmt, ...)
 
 DB::DB(const options& ops, const std::string& dbname)
     : ops(ops), dbname(dbname), translation_table(this), page_manager(this),
-      logger(this), trmgr(this)
+      logger(this), trmgr(this), vlog(this)
 {
     check_options();
     init();
+    if (ops.lazy_rebalance) {
+        rebalancer = std::thread([this]{ this->rebalance_handler(); });
+    }
 }
 
 DB::~DB()
 {
+    quit_rebalancer();
     trmgr.clear();
+    translation_table.quit_page_cleaner();
+    // 最后一次check-point会删除已回收完的value-log文件
+    vlog.quit();
     logger.quit_check_point();
     unlock_db();
 }
@@ -48,7 +62,16 @@ void DB::check_options()
         panic("The optional value of `page_size` is (4K, 8K, 16K, 32K or 64K)");
     }
     header.page_size = ops.page_size;
+    // 第一页紧跟在header所在的页之后
+    header.free_list_head = header.page_size;
     translation_table.set_cache_cap(ops.page_cache_slots);
+    translation_table.set_cache_bytes(ops.cache_bytes);
+    if (ops.int_keys && ops.keycomp) {
+        panic("`int_keys` can not be used with `keycomp`");
+    }
+    limit.int_keys = ops.int_keys;
+    header.int_keys = ops.int_keys;
+    bytewise = !ops.keycomp;
     if (ops.keycomp) {
         comparator = ops.keycomp;
     } else {
@@ -59,11 +82,44 @@ void DB::check_options()
     if (ops.wal_sync != 0 && ops.wal_sync != 1) {
         panic("The optional value of `wal_sync` is (0 or 1)");
     }
+    if (ops.page_clean_interval <= 0) {
+        panic("`page_clean_interval` must be greater than 0");
+    }
+    if (ops.max_dirty_ratio < 0 || ops.max_dirty_ratio > 1) {
+        panic("The optional value of `max_dirty_ratio` is [0, 1]");
+    }
+    if (ops.value_log_file_size == 0) {
+        panic("`value_log_file_size` must be greater than 0");
+    }
+    if (ops.value_log_gc_ratio <= 0 || ops.value_log_gc_ratio > 1) {
+        panic("The optional value of `value_log_gc_ratio` is (0, 1]");
+    }
+    limit.value_log = ops.value_log;
+    if (ops.compaction && ops.compaction_pages == 0) {
+        panic("`compaction_pages` must be greater than 0");
+    }
+    if (ops.recluster && ops.recluster_pages == 0) {
+        panic("`recluster_pages` must be greater than 0");
+    }
+    if (ops.bulk_load_fill < 0.5 || ops.bulk_load_fill > 1) {
+        panic("The optional value of `bulk_load_fill` is [0.5, 1]");
+    }
+    if (ops.rebuild_threads < 0) {
+        panic("`rebuild_threads` must be greater than or equal to 0");
+    }
+    if (ops.split_fill < 0.5 || ops.split_fill > 1) {
+        panic("The optional value of `split_fill` is [0.5, 1]");
+    }
+    if (ops.merge_fill <= 0 || ops.merge_fill * 2 > ops.split_fill) {
+        panic("The optional value of `merge_fill` is (0, split_fill / 2]");
+    }
+    if (ops.lazy_rebalance && ops.rebalance_interval <= 0) {
+        panic("`rebalance_interval` must be greater than 0");
+    }
 }
 
 void DB::init()
 {
-    cur_tid = std::this_thread::get_id();
     if (dbname.empty()) panic("dbname is empty");
     if (dbname.back() != '/') dbname.push_back('/');
     mkdir(dbname.c_str(), 0777);
@@ -72,7 +128,17 @@ void DB::init()
     fd = open_db_file();
     limit.over_value = header.page_size / 16;
     limit.over_value -= sizeof(trx_id_t);
+    // 先按ops.page_size读出header，header.page_size才是数据文件真正的页大小
+    page_io.init(fd, header.page_size, ops.direct_io);
     translation_table.init();
+    page_io.init(fd, header.page_size, ops.direct_io);
+    translation_table.recover();
+    split_bytes = header.page_size * ops.split_fill;
+    merge_bytes = header.page_size * ops.merge_fill;
+    {
+        lock_t lk(rebalance_mtx);
+        underfull.clear();
+    }
     page_manager.init();
     if (header.root_id == 0) {
         header.root_id = page_manager.alloc_page();
@@ -82,7 +148,11 @@ void DB::init()
         root.reset(translation_table.load_node(header.root_id));
     }
     trmgr.init();
+    // 重放wal时可能就要读写value-log了
+    vlog.init();
     logger.init();
+    // 重放wal时还不能有写回和check-point
+    translation_table.start_page_cleaner();
 }
 
 void DB::lock_db()
@@ -105,10 +175,18 @@ void DB::unlock_db()
 
 int DB::open_db_file()
 {
-    int fd = open(dbfile.c_str(), O_RDWR | O_CREAT, 0644);
+    int flags = O_RDWR | O_CREAT;
+#if defined (O_DIRECT)
+    if (ops.direct_io) flags |= O_DIRECT;
+#endif
+    int fd = open(dbfile.c_str(), flags, 0644);
     if (fd < 0) {
         panic("open(%s): %s", dbfile.c_str(), strerror(errno));
     }
+#if !defined (O_DIRECT) && defined (F_NOCACHE)
+    // Mac OS上没有O_DIRECT
+    if (ops.direct_io) fcntl(fd, F_NOCACHE, 1);
+#endif
     return fd;
 }
 
@@ -129,10 +207,17 @@ void DB::wait_sync_point(bool sync_rw_point)
     if (sync_rw_point) while (sync_read_point > 0) ;
 }
 
+// 修改操作在持有root_latch的写锁时递增sync_check_point，所以迭代器持有读锁之后就不会再有新的修改操作了
+// 但已经开始的修改操作可能还要获取root_latch来分裂或收缩根节点，所以我们不能持有读锁等待它们，
+// 而是先放开读锁，等它们结束之后再重试
 DB::iterator *DB::new_iterator()
 {
-    root_latch.lock_shared();
-    wait_sync_point(false);
+    while (true) {
+        root_latch.lock_shared();
+        if (sync_check_point == 0) break;
+        root_latch.unlock_shared();
+        while (sync_check_point > 0) std::this_thread::yield();
+    }
     return new iterator(this);
 }
 
@@ -169,6 +254,28 @@ status DB::find(const std::string& key, std::string *value)
     wait_if_rebuild();
     {
         rlock_t rlk(root_latch);
+        root->pin();
+        root->lock_shared();
+    }
+    sync_read_point++;
+    auto [x, i] = find(root.get(), key);
+    if (!x) {
+        sync_read_point--;
+        return status::not_found();
+    }
+    translation_table.read_value(x, i, value);
+    x->unlock_shared();
+    x->unpin();
+    sync_read_point--;
+    return status::ok();
+}
+
+status DB::read_range(const std::string& key, size_t off, size_t n, std::string *value)
+{
+    wait_if_rebuild();
+    {
+        rlock_t rlk(root_latch);
+        root->pin();
         root->lock_shared();
     }
     sync_read_point++;
@@ -177,27 +284,112 @@ status DB::find(const std::string& key, std::string *value)
         sync_read_point--;
         return status::not_found();
     }
-    translation_table.load_real_value(x->values[i], value);
+    translation_table.read_range(x, i, off, n, value);
     x->unlock_shared();
+    x->unpin();
     sync_read_point--;
     return status::ok();
 }
 
+status DB::write_range(const std::string& key, size_t off, const std::string& data)
+{
+    return write_range(key, off, data, false);
+}
+
+status DB::append(const std::string& key, const std::string& data)
+{
+    return write_range(key, 0, data, true);
+}
+
+// 叶节点中放不下write_range()变长后的value时，就像insert()一样从根节点开始分裂，
+// 到达叶节点之后再在当前的value上覆盖，所以它和之前的读取是原子的
+// 这时叶节点中如果又放不下了，value就是覆盖之后的值，调用者按它的大小再重试一次
+struct range_write {
+    size_t off;
+    const std::string *data;
+    bool append;
+    value_t *value;
+};
+static thread_local range_write pending_range;
+
+// append时off就是value当前的长度，它要在持有叶节点的写锁之后才能确定
+status DB::write_range(const std::string& key, size_t off, const std::string& data, bool append)
+{
+    auto s = check_limit(key, data);
+    if (!s.is_ok()) return s;
+    wait_if_check_point();
+    wait_if_rebuild();
+    sync_check_point++;
+    node *x = find_leaf(key);
+    if (!x) {
+        sync_check_point--;
+        return status::not_found();
+    }
+    value_t *nv = write_range(x, search(x, key), key, off, data, append, &s);
+    release(x);
+    sync_check_point--;
+    while (nv) {
+        pending_range = { off, &data, append, nullptr };
+        wait_if_check_point();
+        wait_if_rebuild();
+        s = insert(key, nv, Write, nullptr);
+        delete nv;
+        nv = pending_range.value;
+    }
+    return s;
+}
+
+// 在持有写锁的叶节点x中覆盖第i个value，叶节点中放不下变长后的value时不做修改并返回它
+value_t *DB::write_range(node *x, int i, const key_t& key, size_t off, const std::string& data, bool append, status *s)
+{
+    if (i == x->size() || !found(x, i, key)) {
+        *s = status::not_found();
+        return nullptr;
+    }
+    value_t *v = x->values[i];
+    if (append) off = v->reallen;
+    if (off > v->reallen || off + data.size() > limit.max_value) {
+        *s = status::error("The offset out of range");
+        return nullptr;
+    }
+    *s = status::ok();
+    if (off + data.size() <= v->reallen && translation_table.write_range(v, off, data)) {
+        logger.append_range(key, off, data);
+        x->update();
+        return nullptr;
+    }
+    // 其他情况都整个写入一个新的value，它的溢出页在check-point时才写入新的页，
+    // 旧的溢出页也要到那时才释放，所以上一次check-point的镜像不会被改动
+    std::string realval;
+    translation_table.load_real_value(v, &realval);
+    realval.replace(off, data.size(), data);
+    value_t *nv = build_new_value(realval, nullptr);
+    if (x->page_used - v->page_used() + nv->page_used() > header.page_size) return nv;
+    logger.append_wal(Update, key, nv);
+    translation_table.free_value(v);
+    x->values[i] = nv;
+    x->update();
+    return nullptr;
+}
+
+// 返回的节点仍持有读锁并被pin住
 std::pair<node*, int> DB::find(node *x, const key_t& key)
 {
     node *child;
     int i = search(x, key);
-    if (i == x->keys.size()) goto not_found;
+    if (i == x->size()) goto not_found;
     if (x->leaf) {
-        if (equal(x->keys[i], key)) return { x, i };
+        if (found(x, i, key)) return { x, i };
         else goto not_found;
     }
-    child = to_node(x->childs[i]);
+    child = to_node(x->child(i));
     child->lock_shared();
     x->unlock_shared();
+    x->unpin();
     return find(child, key);
 not_found:
     x->unlock_shared();
+    x->unpin();
     return { nullptr, 0 };
 }
 
@@ -211,20 +403,33 @@ value_t *DB::build_new_value(const std::string& value, transaction *tx)
 }
 
 static thread_local bool retry = false;
+// 父节点放不下分裂出来的分隔符时，我们会从根节点重试，
+// 这时检查索引节点是否已满就要按最长的key来预留空间了
+// 它只对这一次插入有效，所以每次插入开始和结束时都要清除
+static thread_local bool reserve_max_key = false;
 
 status DB::insert(const std::string& key, const std::string& value, char op, transaction *tx)
 {
+    reserve_max_key = false;
     auto s = check_limit(key, value);
     if (!s.is_ok()) return s;
     wait_if_check_point();
     wait_if_rebuild();
-    value_t *v = build_new_value(value, tx);
+    return insert(key, build_new_value(value, tx), op, tx);
+}
+
+// op为Write时v只用来估计叶节点是否需要分裂，见pending_range
+status DB::insert(const key_t& key, value_t *v, char op, transaction *tx)
+{
+    status s;
+    reserve_max_key = false;
 retry_insert:
     {
         wlock_t wlk(root_latch);
+        root->pin();
         root->lock();
+        if (!retry) sync_check_point++;
     }
-    if (!retry) sync_check_point++;
     retry = false;
     node *r = root.get();
     if (isfull(r, key, v)) {
@@ -236,18 +441,25 @@ retry_insert:
         root.release();
         root.reset(new node(false));
         root->resize(1);
+        root->pin();
         root->lock();
         root_latch.unlock();
-        lock_header();
         root->childs[0] = header.root_id;
+        // put()可能会写回脏页，所以不能在持有header_latch时调用它
         translation_table.put(header.root_id, r);
+        lock_header();
         header.root_id = page_manager.alloc_page();
         unlock_header();
-        split(root.get(), 0, key);
-        if (retry) goto retry_insert;
+        split(root.get(), 0, key, v);
+        r->unpin();
+        if (retry) {
+            root->unpin();
+            goto retry_insert;
+        }
     }
     s = insert(root.get(), key, v, op, tx);
     if (retry) goto retry_insert;
+    reserve_max_key = false;
     sync_check_point--;
     return s;
 }
@@ -258,7 +470,10 @@ status DB::insert(node *x, const key_t& key, value_t *value, char op, transactio
     int n = x->keys.size();
     if (x->leaf) {
         auto s = status::ok();
-        if (i < n && equal(x->keys[i], key)) {
+        if (op == Write) {
+            auto& range = pending_range;
+            range.value = write_range(x, i, key, range.off, *range.data, range.append, &s);
+        } else if (i < n && found(x, i, key)) {
             if (op == Update) {
                 if (tx) tx->record(Update, key, x->values[i]);
                 logger.append_wal(op, key, value);
@@ -278,11 +493,13 @@ status DB::insert(node *x, const key_t& key, value_t *value, char op, transactio
                 }
                 x->keys[i] = key;
                 x->values[i] = value;
-                update_header_in_insert(x, key);
+                update_header_in_insert(x);
                 x->update();
+                x->last_insert = i;
             }
         }
         x->unlock();
+        x->unpin();
         return s;
     } else {
         if (i == n) {
@@ -299,43 +516,57 @@ status DB::insert(node *x, const key_t& key, value_t *value, char op, transactio
         node *child = to_node(x->childs[i]);
         child->lock();
         if (isfull(child, key, value)) {
-            split(x, i, key);
-            if (retry) return status();
-            if (less(x->keys[i], key)) {
-                // key被挪到了childs[i+1]中
+            split(x, i, key, value);
+            if (retry) {
+                x->unpin();
+                child->unpin();
+                return status();
+            }
+            // key被挪到了childs[i+1]中
+            if (less(x->keys[i], key)) i++;
+            // 左插入点分裂后，childs[i]就是新的左节点了
+            if (x->childs[i] != to_page_id(child)) {
                 child->unlock();
-                child = to_node(x->childs[++i]);
+                child->unpin();
+                child = to_node(x->childs[i]);
                 child->lock();
             }
         }
         x->unlock();
+        x->unpin();
         return insert(child, key, value, op, tx);
     }
 }
 
-void DB::update_header_in_insert(node *x, const key_t& key)
+// 最左边的叶节点只会因为左插入点分裂而改变，新的最左叶节点的left为0
+// 我们不能在持有x时再去锁header.leaf_id，这可能会和link_leaf()造成死锁
+// T1: hold(x), require(leaf)
+// T2: hold(leaf), require(leaf->right = x)
+void DB::update_header_in_insert(node *x)
 {
     lock_header();
-    page_id_t leaf_id = header.leaf_id;
-    unlock_header();
-    // 我们不能在lock_header()的情况下去lock(leaf)，这很可能会造成死锁
-    // T1: hold(header), require(leaf)
-    // T2: hold(leaf), require(header)
-    node *leaf = to_node(leaf_id);
-    // 因为我们并没有持有leaf的父节点，所以它可能会被其他线程删除掉
-    if (!leaf->deleted && leaf != x) leaf->lock_shared();
-    lock_header();
-    if (!leaf->deleted && less(key, leaf->keys[0])) header.leaf_id = to_page_id(x);
-    if (!leaf->deleted && leaf != x) leaf->unlock_shared();
+    if (x->left == 0) header.leaf_id = to_page_id(x);
     header.key_nums++;
     unlock_header();
 }
 
-void DB::split(node *x, int i, const key_t& key)
+void DB::split(node *x, int i, const key_t& key, value_t *value)
 {
     node *y = to_node(x->childs[i]);
-    int type = get_split_type(y, key);
-    node *z = split(y, type);
+    int type = get_split_type(y, key, value);
+    key_t sep = separator(y, type, key);
+    // 和isfull()使用同一个阈值，否则x可能在这里被填到split_bytes以上
+    size_t page_used = x->page_used + limit.slot_field + limit.key_len_field + sep.size() + sizeof(page_id_t);
+    if (page_used > split_bytes) {
+        y->unpin();
+        x->unlock();
+        y->unlock();
+        retry = true;
+        reserve_max_key = true;
+        return;
+    }
+    node *z = split(y, type, key);
+    y->unpin();
     if (retry) {
         x->unlock();
         y->unlock();
@@ -347,27 +578,32 @@ void DB::split(node *x, int i, const key_t& key)
         x->copy(j, j - 1);
         if (j > i + 1) x->childs[j] = x->childs[j - 1];
     }
-    x->keys[i] = type == LEFT_INSERT_SPLIT ? key : y->keys.back();
+    x->keys[i] = std::move(sep);
     if (n == 2) {
-        if (type == MID_SPLIT) x->keys[n - 1] = z->keys.back();
-        else if (type == RIGHT_INSERT_SPLIT) x->keys[n - 1] = key;
-        else x->keys[n - 1] = y->keys.back();
+        if (type == RIGHT_INSERT_SPLIT) x->keys[n - 1] = key;
+        else if (type == LEFT_INSERT_SPLIT) x->keys[n - 1] = y->keys.back();
+        else x->keys[n - 1] = z->keys.back();
     }
     x->childs[i + 1] = to_page_id(z);
     if (type == LEFT_INSERT_SPLIT)
         std::swap(x->childs[i], x->childs[i + 1]);
     x->update();
+    z->unpin();
 }
 
-node *DB::split(node *y, int type)
+// 返回的新节点已被pin住
+node *DB::split(node *y, int type, const key_t& key)
 {
     node *z = new node(y->leaf);
+    z->pin();
+    // z放入缓存之后就能被page-cleaner和它的兄弟节点访问到了，所以在填好之前要一直锁住它
+    z->lock();
     if (z->leaf) link_leaf(z, y, type);
     else translation_table.put(page_manager.alloc_page(), z);
     if (retry) return nullptr;
-    if (type == MID_SPLIT) {
+    if (type != RIGHT_INSERT_SPLIT && type != LEFT_INSERT_SPLIT) {
         int n = y->keys.size();
-        int point = ceil(n / 2.0);
+        int point = split_point(y, type, key);
         z->resize(n - point);
         for (int i = point; i < n; i++) {
             z->copy(i - point, y, i);
@@ -376,6 +612,7 @@ node *DB::split(node *y, int type)
         y->remove_from(point);
         z->update();
     }
+    z->unlock();
     return z;
 }
 
@@ -385,25 +622,76 @@ node *DB::split(node *y, int type)
 // 当在叶节点的最左端或最右端插入时，我们就进行插入点分裂而非中间分裂
 // 1) right-insert-point-split
 // [1 2 3] (insert 4) -> [3 4]
-//                      /     \
+//                      |     |
 //                   [1 2 3]->[4]
 // 2) left-insert-point-split
 // [2 3 4] (insert 1) -> [1 4]
-//                      /     \
+//                      |     |
 //                     [1]->[2 3 4]
-int DB::get_split_type(node *x, const key_t& key)
+//
+// 像"sensorId|timestamp"这样的key会在树的中间形成许多各自递增的插入流，
+// 所以我们记下每个叶节点最近一次插入的位置，如果这次插入紧接在它的右边(左边)，
+// 就认为这个叶节点正在被顺序插入，即使它不在树的两端也同样在插入点分裂
+// 插入点在叶节点中间时，key留在插入流所在的一边，另一边的key不会再被挪动
+// 3) ascend-split (上一次插入的是3)
+// [1 2 3 7 8] (insert 4) -> [4 8]
+//                          |     |
+//                    [1 2 3 4]->[7 8]
+// 4) descend-split (上一次插入的是7)
+// [1 2 7 8 9] (insert 6) -> [2 9]
+//                          |     |
+//                       [1 2]->[6 7 8 9]
+int DB::get_split_type(node *x, const key_t& key, value_t *value)
 {
-    int type = MID_SPLIT;
-    if (x->leaf) {
-        if (x->right == 0 && less(x->keys.back(), key)) {
-            type = RIGHT_INSERT_SPLIT;
-        } else if (x->left == 0 && less(key, x->keys[0])) {
-            type = LEFT_INSERT_SPLIT;
-        }
-    }
-    return type;
+    if (!x->leaf) return MID_SPLIT;
+    int n = x->keys.size();
+    int i = search(x, key);
+    // 更新已有的key时并不会插入新的key
+    if (i < n && found(x, i, key)) return MID_SPLIT;
+    bool ascend = x->last_insert >= 0 && x->last_insert == i - 1;
+    bool descend = x->last_insert >= 0 && x->last_insert == i;
+    if (i == n && (x->right == 0 || ascend)) return RIGHT_INSERT_SPLIT;
+    if (i == 0 && (x->left == 0 || descend)) return LEFT_INSERT_SPLIT;
+    // 加入key的那一边不能超过split_fill，否则下一次插入就又要分裂了，这时还是从中间分裂
+    if (ascend && leaf_used_split(x, i, n, key, value) <= split_bytes) return ASCEND_SPLIT;
+    if (descend && leaf_used_split(x, 0, i, key, value) <= split_bytes) return DESCEND_SPLIT;
+    return MID_SPLIT;
+}
+
+// y中的[0, point)留在y中，[point, n)被挪到新的右节点中
+int DB::split_point(node *y, int type, const key_t& key)
+{
+    if (type == ASCEND_SPLIT || type == DESCEND_SPLIT) return search(y, key);
+    return ceil(y->keys.size() / 2.0);
+}
+
+// 分裂y之后父节点中新加入的分隔符，它是左边节点的上界
+// 叶节点分裂时我们选取能区分左右两边的最短的key，这样索引节点就能容纳更多的key
+// 索引节点分裂时不能截短，因为我们并不知道右边子树中最小的key是什么
+key_t DB::separator(node *y, int type, const key_t& key)
+{
+    if (type == LEFT_INSERT_SPLIT) return shortest_separator(key, y->keys[0]);
+    if (type == RIGHT_INSERT_SPLIT) return shortest_separator(y->keys.back(), key);
+    int point = split_point(y, type, key);
+    // 插入流的key要分到它所在的那一边
+    if (type == ASCEND_SPLIT) return shortest_separator(key, y->keys[point]);
+    if (type == DESCEND_SPLIT) return shortest_separator(y->keys[point - 1], key);
+    if (!y->leaf) return y->keys[point - 1];
+    return shortest_separator(y->keys[point - 1], y->keys[point]);
 }
 
+// 返回满足l <= sep < r的最短的sep，只对按字节比较的key有效
+key_t DB::shortest_separator(const key_t& l, const key_t& r)
+{
+    // 整数key必须是定长的
+    if (!bytewise || limit.int_keys) return l;
+    size_t n = common_prefix(l, r);
+    // r[0, n]在第n个字节上大于l，所以一定大于l
+    if (n < l.size() && n + 1 < r.size()) return r.substr(0, n + 1);
+    return l;
+}
+
+// z要先放入缓存，然后兄弟节点才能指向它，否则顺着兄弟节点找过来的读操作会从磁盘加载z
 void DB::link_leaf(node *z, node *y, int type)
 {
     page_id_t z_page_id;
@@ -413,51 +701,67 @@ void DB::link_leaf(node *z, node *y, int type)
         if (y->left > 0) {
             node *r = to_node(y->left);
             if (!r->latch.try_lock()) {
+                r->unpin();
+                z->unlock();
                 delete z;
                 retry = true;
                 return;
             }
             z_page_id = page_manager.alloc_page();
+            z->mark_dirty();
+            translation_table.put(z_page_id, z);
             r->right = z_page_id;
-            r->dirty = true;
+            r->mark_dirty();
             r->unlock();
+            r->unpin();
         } else {
             z_page_id = page_manager.alloc_page();
+            z->mark_dirty();
+            translation_table.put(z_page_id, z);
         }
         y->left = z_page_id;
     } else { // [y z]
         z_page_id = page_manager.alloc_page();
         z->left = to_page_id(y);
         z->right = y->right;
+        z->mark_dirty();
+        translation_table.put(z_page_id, z);
         if (y->right > 0) {
             node *r = to_node(y->right);
             r->lock();
             r->left = z_page_id;
-            r->dirty = true;
+            r->mark_dirty();
             r->unlock();
+            r->unpin();
         }
         y->right = z_page_id;
     }
-    z->dirty = true;
-    y->dirty = true;
-    translation_table.put(z_page_id, z);
+    y->mark_dirty();
 }
 
+// 为true时erase()只沿着key借用或合并，而不删除key，见rebalance_handler()
+static thread_local bool rebalance_only = false;
+
 void DB::erase(const std::string& key, transaction *tx)
 {
+    if (ops.lazy_rebalance && !rebalance_only) {
+        lazy_erase(key, tx);
+        return;
+    }
     wait_if_check_point();
     wait_if_rebuild();
     {
         wlock_t wlk(root_latch);
+        root->pin();
         root->lock();
+        sync_check_point++;
     }
-    sync_check_point++;
     erase(root.get(), key, nullptr, tx);
     {
         rlock_t rlk(root_latch);
         root->lock_shared();
     }
-    if (!root->leaf && root->keys.size() == 1) {
+    if (!root->leaf && root->size() == 1) {
         root->unlock_shared();
         root_latch.lock();
         root->lock();
@@ -467,6 +771,7 @@ void DB::erase(const std::string& key, transaction *tx)
         translation_table.release_root(r);
         root.reset(r);
         root_latch.unlock();
+        r->unpin();
         lock_header();
         page_manager.free_page(header.root_id);
         header.root_id = page_id;
@@ -481,71 +786,159 @@ void DB::erase(node *r, const key_t& key, node *precursor, transaction *tx)
 {
     int i = search(r, key);
     int n = r->keys.size();
-    if (i == n) { r->unlock(); return; }
+    if (i == n) {
+        r->unlock();
+        r->unpin();
+        return;
+    }
     if (r->leaf) {
-        if (i < n && equal(r->keys[i], key)) {
-            if (tx) tx->record(Insert, key, r->values[i]);
-            logger.append_wal(Delete, key, r->values[i]);
-            translation_table.free_value(r->values[i]);
-            r->remove(i);
-            lock_header();
-            header.key_nums--;
-            unlock_header();
+        if (!rebalance_only && found(r, i, key)) {
+            erase_in_leaf(r, i, key, tx);
+        }
+        if (precursor && precursor != r) {
+            precursor->unlock();
+            precursor->unpin();
         }
-        if (precursor && precursor != r) precursor->unlock();
         r->unlock();
+        r->unpin();
         return;
     }
+    // precursor已经被pin住并持有写锁了
     node *x = to_node(r->childs[i]);
     if (x != precursor) x->lock();
-    if (!precursor && (i < n && equal(r->keys[i], key))) {
+    else x->unpin();
+    // 只重平衡时key并不会被删除，分隔符也就不必改变
+    if (!rebalance_only && !precursor && found(r, i, key)) {
         // 这种情况下，我们就需要一直持有当前precursor的写锁，直至整个删除操作完成
         precursor = get_precursor(x);
     }
-    if (precursor) {
-        r->keys[i] = precursor->keys[precursor->keys.size() - 2];
-        r->update();
+    // 惰性删除留下的分隔符可能已经不在叶节点中了，这时precursor中最大的key并不是key，
+    // 用它前面的key作为分隔符就会比叶节点中的某些key小
+    if (precursor && precursor->keys.size() >= 2 && equal(precursor->keys.back(), key)) {
+        // 原来的分隔符仍然是左边子树的上界，所以新的分隔符会让r超过split_fill时保留它也没问题
+        auto& sep = precursor->keys[precursor->keys.size() - 2];
+        if (r->page_used - r->keys[i].size() + sep.size() <= split_bytes) {
+            r->keys[i] = sep;
+            r->update();
+        }
     }
-    size_t t = header.page_size / 2;
-    if (x->page_used >= t) {
+    if (x->page_used >= merge_bytes) {
         r->unlock();
+        r->unpin();
         erase(x, key, precursor, tx);
         return;
     }
     node *y = i - 1 >= 0 ? to_node(r->childs[i - 1]) : nullptr;
-    node *z = i + 1 < r->keys.size() ? to_node(r->childs[i + 1]) : nullptr;
+    node *z = i + 1 < n ? to_node(r->childs[i + 1]) : nullptr;
     if (y && y != precursor) y->lock();
+    else if (y) y->unpin();
     if (z && z != precursor) z->lock();
-    if (y && y->page_used >= t) {
-        if (z && z != precursor) z->unlock();
+    else if (z) z->unpin();
+    if (y && y->page_used >= merge_bytes && can_borrow(r, i - 1, x, y, y->keys.size() - 1)) {
+        if (z && z != precursor) release(z);
         borrow_from_left(r, x, y, i - 1);
-        r->unlock();
-        if (y != precursor) y->unlock();
+        release(r);
+        if (y != precursor) release(y);
         erase(x, key, precursor, tx);
-    } else if (z && z->page_used >= t) {
-        if (y && y != precursor) y->unlock();
+    } else if (z && z->page_used >= merge_bytes && can_borrow(r, i, x, z, 0)) {
+        if (y && y != precursor) release(y);
         borrow_from_right(r, x, z, i);
-        r->unlock();
-        if (z != precursor) z->unlock();
+        release(r);
+        if (z != precursor) release(z);
+        erase(x, key, precursor, tx);
+    } else if (y && can_merge(y, x)) {
+        // 被合并掉的节点会一直持有写锁直到被释放
+        if (z && z != precursor) release(z);
+        page_id_t page_id = r->childs[i - 1];
+        r->remove(i - 1);
+        r->childs[i - 1] = page_id;
+        merge(y, x);
+        release(r);
+        if (x != precursor) x->unpin();
+        erase(y, key, precursor, tx);
+    } else if (z && can_merge(x, z)) {
+        if (y && y != precursor) release(y);
+        page_id_t page_id = r->childs[i];
+        r->remove(i);
+        r->childs[i] = page_id;
+        merge(x, z);
+        release(r);
+        if (z != precursor) z->unpin();
         erase(x, key, precursor, tx);
     } else {
-        if (y) {
-            if (z && z != precursor) z->unlock();
-            page_id_t page_id = r->childs[i - 1];
-            r->remove(i - 1);
-            r->childs[i - 1] = page_id;
-            merge(y, x);
-            r->unlock();
-            erase(y, key, precursor, tx);
-        } else {
-            page_id_t page_id = r->childs[i];
-            r->remove(i);
-            r->childs[i] = page_id;
-            merge(x, z);
-            r->unlock();
-            erase(x, key, precursor, tx);
+        // 叶节点的公共前缀在合并后可能会变短，以至于放不下了，这时就让x保持不满
+        if (y && y != precursor) release(y);
+        if (z && z != precursor) release(z);
+        release(r);
+        erase(x, key, precursor, tx);
+    }
+}
+
+void DB::erase_in_leaf(node *x, int i, const key_t& key, transaction *tx)
+{
+    if (tx) tx->record(Insert, key, x->values[i]);
+    logger.append_wal(Delete, key, x->values[i]);
+    translation_table.free_value(x->values[i]);
+    x->remove(i);
+    lock_header();
+    header.key_nums--;
+    unlock_header();
+}
+
+// 只锁住key所在的叶节点，删除后不借用也不合并，即使叶节点变空了也保留在树中
+// 不足merge_fill的叶节点会被记下来，稍后由rebalancer处理
+void DB::lazy_erase(const key_t& key, transaction *tx)
+{
+    wait_if_check_point();
+    wait_if_rebuild();
+    sync_check_point++;
+    node *x = find_leaf(key);
+    if (!x) {
+        sync_check_point--;
+        return;
+    }
+    int i = search(x, key);
+    if (i < x->size() && found(x, i, key)) {
+        erase_in_leaf(x, i, key, tx);
+        if (x != root.get() && x->page_used < merge_bytes) {
+            lock_t lk(rebalance_mtx);
+            underfull.emplace(to_page_id(x), key);
         }
     }
+    release(x);
+    sync_check_point--;
+}
+
+void DB::rebalance_handler()
+{
+    while (!quit_rebalance) {
+        std::unordered_map<page_id_t, key_t> pages;
+        {
+            std::unique_lock<std::mutex> ulock(rebalance_mtx);
+            rebalance_cv.wait_for(ulock, std::chrono::milliseconds(ops.rebalance_interval),
+                                  [this]{ return quit_rebalance.load(); });
+            if (quit_rebalance) break;
+            pages.swap(underfull);
+        }
+        // 叶节点在此期间可能已经被合并或重新填满了，沿着key下降时只会处理仍然不足的节点
+        rebalance_only = true;
+        for (auto& [page_id, key] : pages) {
+            if (quit_rebalance) break;
+            erase(key, nullptr);
+        }
+        rebalance_only = false;
+    }
+}
+
+void DB::quit_rebalancer()
+{
+    {
+        lock_t lk(rebalance_mtx);
+        quit_rebalance = true;
+    }
+    rebalance_cv.notify_one();
+    if (rebalancer.joinable())
+        rebalancer.join();
 }
 
 node *DB::get_precursor(node *x)
@@ -554,7 +947,7 @@ node *DB::get_precursor(node *x)
     while (!x->leaf) {
         node *y = to_node(x->childs[x->keys.size() - 1]);
         y->lock();
-        if (x != r) x->unlock();
+        if (x != r) release(x);
         x = y;
     }
     return x;
@@ -607,33 +1000,219 @@ void DB::merge(node *y, node *x)
             node *r = to_node(x->right);
             r->lock();
             r->left = to_page_id(y);
-            r->dirty = true;
-            r->unlock();
+            r->mark_dirty();
+            release(r);
         }
     }
     x->free();
     y->update();
 }
 
+// value-log的垃圾回收，见value_log::gc()
+// 如果key的value仍是file中off处的那一个，就把它读到内存中，下次写回时它会被追加到当前的文件中
+// value的内容并没有改变，所以不必写wal，崩溃后叶节点引用的仍是旧的文件
+void DB::relocate(const key_t& key, uint32_t file, uint64_t off)
+{
+    wait_if_check_point();
+    wait_if_rebuild();
+    sync_check_point++;
+    node *x = find_leaf(key);
+    if (!x) {
+        sync_check_point--;
+        return;
+    }
+    int i = search(x, key);
+    if (i < x->size() && found(x, i, key)) {
+        value_t *v = x->values[i];
+        if (v->vlog_file == file && v->vlog_off == off) {
+            value_t *nv = new value_t();
+            nv->reallen = v->reallen;
+            nv->trx_id = v->trx_id;
+            nv->val = new std::string();
+            translation_table.load_real_value(v, nv->val);
+            translation_table.free_value(v);
+            x->values[i] = nv;
+            x->update();
+        }
+    }
+    release(x);
+    sync_check_point--;
+}
+
+// 返回key所在的叶节点，它持有写锁并被pin住，路径上的索引节点只需持有读锁
+// key大于树中所有的key时返回nullptr
+node *DB::find_leaf(const key_t& key)
+{
+    {
+        wlock_t wlk(root_latch);
+        root->pin();
+        if (root->leaf) root->lock();
+        else root->lock_shared();
+    }
+    node *x = root.get();
+    while (!x->leaf) {
+        int i = search(x, key);
+        if (i == x->size()) {
+            x->unlock_shared();
+            x->unpin();
+            return nullptr;
+        }
+        node *child = to_node(x->child(i));
+        if (child->leaf) child->lock();
+        else child->lock_shared();
+        x->unlock_shared();
+        x->unpin();
+        x = child;
+    }
+    return x;
+}
+
 // 查找x->keys[]中大于等于key的关键字的索引位置
 int DB::search(node *x, const key_t& key)
 {
-    auto comp = comparator;
-    auto p = std::lower_bound(x->keys.begin(), x->keys.end(), key, comp);
-    if (p == x->keys.end()) return x->keys.size();
+    // find()和erase()并不检查key的长度
+    if (limit.int_keys && key.size() == limit.int_key_len) {
+        return lower_bound_u64(x->ikeys.data(), x->ikeys.size(), decode_be64(key.data()));
+    }
+    if (x->packed) {
+        if (bytewise) return search_packed(x, key);
+        int lo = 0, hi = x->size();
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (comparator(key_at(x, mid), key)) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+    if (bytewise) {
+        return std::lower_bound(x->keys.begin(), x->keys.end(), key) - x->keys.begin();
+    }
+    auto p = std::lower_bound(x->keys.begin(), x->keys.end(), key, std::cref(comparator));
     return std::distance(x->keys.begin(), p);
 }
 
+// 按字节比较时，packed节点中的key都有相同的前缀，所以只需和前缀比较一次，
+// 然后在后缀上二分，整个过程不会拷贝任何key
+int DB::search_packed(node *x, const key_t& key)
+{
+    auto prefix = x->packed_prefix();
+    std::string_view k(key);
+    int c = k.substr(0, prefix.size()).compare(prefix);
+    if (c < 0) return 0;
+    if (c > 0) return x->size();
+    k.remove_prefix(prefix.size());
+    int lo = 0, hi = x->size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (x->packed_suffix(mid) < k) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// search()返回的位置i上的key是否等于key
+// 我们已经知道!(keys[i] < key)了，所以只需再比较一次
+bool DB::found(node *x, int i, const key_t& key)
+{
+    if (x->packed && bytewise) {
+        auto prefix = x->packed_prefix();
+        auto suffix = x->packed_suffix(i);
+        return key.size() == prefix.size() + suffix.size() &&
+               key.compare(0, prefix.size(), prefix) == 0 &&
+               key.compare(prefix.size(), suffix.size(), suffix) == 0;
+    }
+    if (!x->packed) return !less(key, x->keys[i]);
+    return !less(key, key_at(x, i));
+}
+
+// 对于packed的节点，key会被拷贝到线程局部的缓冲区中，它只在下一次调用之前有效
+// 缓冲区的容量会被复用，所以这并不会分配内存
+const key_t& DB::key_at(node *x, int i)
+{
+    if (!x->packed) return x->keys[i];
+    static thread_local key_t key;
+    x->packed_key(i, key);
+    return key;
+}
+
 bool DB::isfull(node *x, const key_t& key, value_t *value)
 {
-    size_t page_used = x->page_used;
+    size_t page_used;
     if (x->leaf) {
-        page_used += (limit.key_len_field + key.size());
-        page_used += (limit.value_len_field + sizeof(trx_id_t) + std::min(limit.over_value, (size_t)value->reallen));
+        page_used = leaf_used_with(x, key, value);
     } else {
-        page_used += (limit.key_len_field + limit.max_key) + sizeof(page_id_t);
+        // 插入key时x的右边界可能会被更新为key，分裂子节点时还要再加入一个分隔符
+        // 分隔符通常都被截短了，所以我们先按key的长度预留空间，
+        // 如果分裂时发现放不下，再从根节点重试，见split()
+        page_used = x->page_used;
+        if (!x->keys.empty() && less(x->keys.back(), key) && key.size() > x->keys.back().size())
+            page_used += key.size() - x->keys.back().size();
+        size_t sep = reserve_max_key ? limit.max_key : key.size();
+        page_used += limit.slot_field + limit.key_len_field + sep + sizeof(page_id_t);
+    }
+    return page_used > split_bytes;
+}
+
+// 向叶节点x中加入key之后它将占用的页空间
+// 新的key可能会让公共前缀变短，这样x中已有的每个key都要多占一些空间
+size_t DB::leaf_used_with(node *x, const key_t& key, value_t *value)
+{
+    size_t n = x->keys.size();
+    size_t prefix = n > 0 ? std::min((size_t)x->prefix, common_prefix(x->keys[0], key)) : key.size();
+    size_t page_used = x->page_used + (x->prefix - prefix) * n - x->prefix + prefix;
+    page_used += limit.slot_field + limit.key_len_field + key.size() - prefix;
+    page_used += value->page_used();
+    return page_used;
+}
+
+// 合并叶节点y和x之后将占用的页空间
+size_t DB::leaf_used_merged(node *y, node *x)
+{
+    size_t yn = y->keys.size(), xn = x->keys.size();
+    if (yn == 0) return x->page_used;
+    if (xn == 0) return y->page_used;
+    size_t prefix = std::min({ (size_t)y->prefix, (size_t)x->prefix, common_prefix(y->keys[0], x->keys[0]) });
+    size_t header_used = limit.type_field + limit.key_nums_field + limit.prefix_len_field + sizeof(page_id_t) * 2;
+    return y->page_used + (y->prefix - prefix) * yn - y->prefix +
+           x->page_used + (x->prefix - prefix) * xn - x->prefix - header_used + prefix;
+}
+
+// 从叶节点y中去掉[from, to)并加入key之后它将占用的页空间
+// 剩下的key的公共前缀只会更长，所以这是一个上界
+size_t DB::leaf_used_split(node *y, int from, int to, const key_t& key, value_t *value)
+{
+    size_t prefix = std::min((size_t)y->prefix, common_prefix(y->keys[0], key));
+    size_t page_used = leaf_used_with(y, key, value);
+    for (int j = from; j < to; j++) {
+        page_used -= limit.slot_field + limit.key_len_field + y->keys[j].size() - prefix;
+        page_used -= y->values[j]->page_used();
+    }
+    return page_used;
+}
+
+// 从y中借用第i个key到x中，r中的第j个分隔符也会随之改变
+bool DB::can_borrow(node *r, int j, node *x, node *y, int i)
+{
+    // 惰性删除后y中可能只剩下一个key了，借走它y就空了
+    if (y->keys.size() < 2) return false;
+    // 向左借用时，新的分隔符是y中借出之后剩下的最大的key
+    auto& sep = i == 0 ? y->keys[0] : y->keys[i - 1];
+    // 换上新的分隔符之后r也不能超过split_fill
+    if (r->page_used - r->keys[j].size() + sep.size() > split_bytes) return false;
+    // 索引节点不做前缀压缩
+    if (!x->leaf) return true;
+    return leaf_used_with(x, y->keys[i], y->values[i]) <= split_bytes;
+}
+
+// 合并后的节点不能超过split_fill，否则下一次插入就又要分裂了
+// 另一个节点不一定不足merge_fill，所以索引节点也要检查
+bool DB::can_merge(node *y, node *x)
+{
+    if (!y->leaf) {
+        size_t header_used = limit.type_field + limit.key_nums_field + limit.prefix_len_field;
+        return y->page_used + x->page_used - header_used <= split_bytes;
     }
-    return page_used > header.page_size;
+    return leaf_used_merged(y, x) <= split_bytes;
 }
 
 status DB::check_limit(const std::string& key, const std::string& value)
@@ -644,40 +1223,410 @@ status DB::check_limit(const std::string& key, const std::string& value)
     if (value.size() > limit.max_value) {
         return status::error("The value out of range [0, 4294967295]");
     }
+    if (limit.int_keys && key.size() != limit.int_key_len) {
+        return status::error("The key must be 8 bytes with `int_keys`");
+    }
     return status::ok();
 }
 
+// 不少于这么多页的空闲区间才会被打洞
+static const size_t min_punch_pages = 16;
+// 物理上连续的叶节点不少于这么多页时，重聚簇就不再挪动它们
+static const size_t min_cluster_pages = 8;
+// 重聚簇时一批最多挪动的页数，它们会被挪到一段连续的空闲页中
+static const size_t max_cluster_pages = 64;
+
+// 挪动节点时也要阻塞所有读操作，iterator会一直持有root_latch，这时就等到下一次再挪动
+bool DB::lock_for_relocation()
+{
+    if (!root_latch.try_lock()) return false;
+    root->lock();
+    root->unlock();
+    wait_sync_point(true);
+    return true;
+}
+
+void DB::unlock_for_relocation(std::vector<node*>& pinned)
+{
+    for (auto x : pinned) {
+        x->unpin();
+    }
+    root_latch.unlock();
+}
+
+// 按层遍历出所有节点的位置，只有索引节点需要加载并被pin住，叶节点等到要挪动时才加载
+// 每一层的节点都是按key的顺序排列的，返回叶节点在refs中的起始位置
+size_t DB::collect_page_refs(std::vector<page_ref>& refs, std::vector<node*>& pinned)
+{
+    refs = { { header.root_id, nullptr, 0 } };
+    pinned = { root.get() };
+    std::vector<node*> level = { root.get() };
+    root->pin();
+    size_t from = 0;
+    while (!level[0]->leaf) {
+        from = refs.size();
+        for (auto x : level) {
+            for (int i = 0; i < x->size(); i++) {
+                refs.push_back({ x->child(i), x, i });
+            }
+        }
+        node *first = to_node(refs[from].page_id);
+        bool leaf = first->leaf;
+        first->unpin();
+        if (leaf) break;
+        level.clear();
+        for (size_t k = from; k < refs.size(); k++) {
+            level.push_back(to_node(refs[k].page_id));
+            pinned.push_back(level.back());
+        }
+    }
+    return from;
+}
+
+// 把每个节点挪到对应的新页中，然后修改父节点、兄弟节点和header中的指针，并释放旧的页
+//
+// 节点总是先写入新的页并落盘，然后才修改指向它的指针，而旧的页在新的header落盘之前
+// 不会被复用，所以崩溃后看到的要么是原来的树，要么是挪动之后的树
+void DB::move_nodes(const page_moves& moves)
+{
+    std::unordered_map<page_id_t, page_id_t> new_page_ids;
+    std::vector<node*> moved;
+    for (auto& [ref, to] : moves) {
+        node *x = to_node(ref.page_id);
+        translation_table.move_node(x, to);
+        moved.push_back(x);
+        new_page_ids[ref.page_id] = to;
+    }
+    sync_fd(fd);
+    auto to_new_page_id = [&new_page_ids](page_id_t page_id) {
+        auto it = new_page_ids.find(page_id);
+        return it != new_page_ids.end() ? it->second : page_id;
+    };
+    for (size_t k = 0; k < moves.size(); k++) {
+        auto& [ref, to] = moves[k];
+        node *x = moved[k];
+        if (ref.parent) {
+            ref.parent->lock();
+            ref.parent->childs[ref.i] = to;
+            ref.parent->mark_dirty();
+            ref.parent->unlock();
+        } else {
+            lock_header();
+            header.root_id = to;
+            unlock_header();
+        }
+        if (x->leaf) {
+            if (x->left > 0) {
+                node *l = to_node(to_new_page_id(x->left));
+                l->right = to;
+                l->mark_dirty();
+                l->unpin();
+            } else {
+                lock_header();
+                header.leaf_id = to;
+                unlock_header();
+            }
+            if (x->right > 0) {
+                node *r = to_node(to_new_page_id(x->right));
+                r->left = to;
+                r->mark_dirty();
+                r->unpin();
+            }
+        }
+        x->unpin();
+        page_manager.free_page(ref.page_id);
+    }
+}
+
+// 在线压缩，由check-point线程在刷完脏页之后调用，此时所有修改操作都已被阻塞
+//
+// 我们从文件末尾开始，把节点挪到最前面的空闲页中，之后文件末尾的空闲页就可以截断了，
+// 溢出页不会被挪动，所以它们之后的空闲页只能打洞
+void DB::compact(size_t max_pages)
+{
+    page_manager.drain_caches();
+    if (!page_manager.has_free_pages()) return;
+    if (!lock_for_relocation()) return;
+    std::vector<page_ref> refs;
+    std::vector<node*> pinned;
+    collect_page_refs(refs, pinned);
+    std::sort(refs.begin(), refs.end(), [](const page_ref& l, const page_ref& r) {
+        return l.page_id > r.page_id;
+    });
+    page_moves moves;
+    for (auto& ref : refs) {
+        if (moves.size() >= max_pages) break;
+        page_id_t to = page_manager.alloc_below(ref.page_id);
+        if (to == 0) break;
+        moves.emplace_back(ref, to);
+    }
+    move_nodes(moves);
+    unlock_for_relocation(pinned);
+    // 写回被修改的指针，旧的页要等到新的header落盘之后才会被释放
+    translation_table.flush();
+    // 再保存截断之后的header和freemap，之后才能截断文件
+    page_manager.drain_caches();
+    page_id_t file_size = page_manager.trim();
+    translation_table.flush();
+    page_io.truncate(file_size);
+    for (auto [page_id, n] : page_manager.free_runs(min_punch_pages)) {
+        page_io.punch_hole(page_id, n * header.page_size);
+    }
+}
+
+// 由check-point线程完成，见logger::clean_handler()
+void DB::recluster()
+{
+    Recluster = true;
+    while (Recluster) {
+        logger.check_point();
+        wait_if_check_point();
+    }
+}
+
+// 叶节点重聚簇，和compact()一样由check-point线程在刷完脏页之后调用
+//
+// 随机插入时分裂出来的叶节点散落在文件各处，沿着node::right扫描时每个叶节点都是一次随机读
+// 我们按key的顺序遍历叶节点，把不足min_cluster_pages页的连续片段攒成一批，
+// 然后整批挪到一段连续的空闲页中，这样它们在文件中的顺序就和key的顺序一致了，
+// 扫描时读到的就是顺序的页，内核的预读也能发挥作用
+//
+// 开启compaction时不会从文件末尾分配，以免挪过去的节点又被逐个挪回前面的空洞中
+// 有iterator持有root_latch时什么也不做并返回false
+bool DB::recluster(size_t max_pages)
+{
+    page_manager.drain_caches();
+    if (!lock_for_relocation()) return false;
+    std::vector<page_ref> refs;
+    std::vector<node*> pinned;
+    size_t from = collect_page_refs(refs, pinned);
+    size_t page_size = header.page_size;
+    page_moves moves;
+    std::vector<page_ref> batch;
+    // 挪动一批叶节点，找不到足够大的连续空闲页时返回false
+    auto move_batch = [&]() {
+        size_t n = batch.size();
+        if (n >= 2) {
+            page_id_t to = page_manager.alloc_run(n, !ops.compaction);
+            if (to == 0) return false;
+            for (size_t k = 0; k < n; k++) {
+                moves.emplace_back(batch[k], to + (off_t)(k * page_size));
+            }
+        }
+        batch.clear();
+        return true;
+    };
+    // 根节点是叶节点时只有一个叶节点
+    size_t k = from == 0 ? refs.size() : from;
+    bool ok = true;
+    while (ok && k < refs.size() && moves.size() + batch.size() < max_pages) {
+        // [k, e)在文件中是连续的
+        size_t e = k + 1;
+        while (e < refs.size() && refs[e].page_id == refs[e - 1].page_id + (off_t)page_size) e++;
+        if (e - k >= min_cluster_pages) {
+            ok = move_batch();
+        } else {
+            for (size_t j = k; j < e && ok; j++) {
+                batch.push_back(refs[j]);
+                if (batch.size() == max_cluster_pages) ok = move_batch();
+            }
+        }
+        k = e;
+    }
+    if (ok) move_batch();
+    move_nodes(moves);
+    unlock_for_relocation(pinned);
+    // 旧的页在新的header落盘之前不能被复用
+    translation_table.flush();
+    return true;
+}
+
 #include <dirent.h>
 
-void DB::rebuild()
+status DB::bulk_load(const Source& source)
+{
+    return bulk_load(std::vector<Source>{ source });
+}
+
+static status load_source(bulk_loader& loader, const Source& source)
+{
+    std::string key, value;
+    while (source(&key, &value)) {
+        auto s = loader.add(key, value);
+        if (!s.is_ok()) return s;
+    }
+    return status::ok();
+}
+
+// 每个source在各自的线程中导入一段叶节点，后一个source中的key必须都大于前一个的
+// 然后由当前线程依次链接各段叶节点，并在所有叶节点之上构建索引节点
+// 只有一个source时就不必另开线程了，索引节点也是边导入边构建的
+status DB::bulk_load(const std::vector<Source>& sources)
 {
-    char tmpname[] = "tmp.XXXXXX";
-    mktemp(tmpname);
     {
         wlock_t wlk(root_latch);
-        if (Rebuild) return;
+        if (Rebuild) return status::error("The database is being rebuilt");
         logger.check_point();
         wait_if_check_point();
         Rebuild = true;
         wait_sync_point(true);
     }
-    DB *tmpdb = new DB(options(), tmpname);
-    auto *it = new_iterator();
-    for (it->seek_to_first(); it->valid(); it->next()) {
-        tmpdb->insert(it->key(), it->value());
+    if (header.key_nums > 0 || !root->leaf) {
+        Rebuild = false;
+        return status::error("bulk_load() requires an empty database");
     }
-    delete it;
-    delete tmpdb;
-    DIR *dirp = opendir(dbname.c_str());
+    auto s = status::ok();
+    bulk_loader loader(this, ops.bulk_load_fill);
+    if (sources.size() == 1) {
+        s = load_source(loader, sources[0]);
+    } else {
+        size_t n = sources.size();
+        std::vector<std::unique_ptr<bulk_loader>> loaders;
+        std::vector<status> results(n);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < n; i++) {
+            loaders.emplace_back(new bulk_loader(this, ops.bulk_load_fill, true));
+        }
+        for (size_t i = 0; i < n; i++) {
+            workers.emplace_back([this, &loaders, &results, &sources, i]{
+                results[i] = load_source(*loaders[i], sources[i]);
+                loaders[i]->finish();
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        // 出错的那一段之后的都不要了，和只有一个source时一样
+        for (size_t i = 0; i < n; i++) {
+            loader.append(*loaders[i]);
+            if (!results[i].is_ok()) {
+                s = results[i];
+                break;
+            }
+        }
+    }
+    node *r = loader.finish();
+    if (r) {
+        // 原来的根节点是一个空的叶节点
+        page_manager.free_page(header.root_id);
+        header.root_id = r->page_id;
+        header.leaf_id = loader.first_leaf();
+        header.key_nums = loader.key_nums();
+        root.reset(r);
+    }
+    // 所有节点都落盘之后才写入新的header，它就是导入完成的标记
+    sync_fd(fd);
+    translation_table.flush();
+    Rebuild = false;
+    return s;
+}
+
+// 按根节点中的分隔符把整棵树划分为至多n段，每一段都是相邻的几棵子树，
+// 返回按顺序读出每一段中的key和value的source，调用者需保证此时树不会被修改
+std::vector<Source> DB::partition_sources(int n)
+{
+    // 每一段从第一棵子树最左边的叶节点开始，到下一段的第一个叶节点为止
+    auto leftmost_leaf = [this](page_id_t page_id) {
+        while (true) {
+            node *x = to_node(page_id);
+            bool leaf = x->leaf;
+            page_id_t child = leaf ? 0 : x->child(0);
+            x->unpin();
+            if (leaf) return page_id;
+            page_id = child;
+        }
+    };
+    std::vector<page_id_t> firsts;
+    int children = root->leaf ? 1 : root->size();
+    n = std::max(1, std::min(n, children));
+    for (int i = 0; i < n; i++) {
+        int c = (size_t)i * children / n;
+        firsts.push_back(root->leaf ? header.leaf_id : leftmost_leaf(root->child(c)));
+    }
+    firsts.push_back(0);
+    // 读到的叶节点一直被pin住，直到换到下一个叶节点或者source被销毁
+    struct cursor {
+        ~cursor() { if (x) x->unpin(); }
+        node *x = nullptr;
+        page_id_t page_id;
+        page_id_t end;
+        int i = 0;
+    };
+    std::vector<Source> sources;
+    for (int i = 0; i < n; i++) {
+        auto c = std::make_shared<cursor>();
+        c->page_id = firsts[i];
+        c->end = firsts[i + 1];
+        sources.emplace_back([this, c](std::string *key, std::string *value) {
+            while (c->page_id != c->end) {
+                if (!c->x) c->x = translation_table.to_node(c->page_id, true);
+                node *x = c->x;
+                rlock_t rlk(x->latch);
+                if (c->i < x->size()) {
+                    key->assign(key_at(x, c->i));
+                    translation_table.read_value(x, c->i++, value);
+                    return true;
+                }
+                c->page_id = x->right;
+                c->i = 0;
+                rlk.unlock();
+                x->unpin();
+                c->x = nullptr;
+            }
+            return false;
+        });
+    }
+    return sources;
+}
+
+// 按根节点的分隔符把key划分为几段，由多个线程并行地导入新的数据库，见bulk_load()
+// 删除目录dir及其中的所有文件
+static void remove_dir(const std::string& dir)
+{
+    DIR *dirp = opendir(dir.c_str());
+    if (!dirp) return;
     struct dirent *dp;
     while ((dp = readdir(dirp))) {
-        auto rf = dbname + dp->d_name;
+        auto rf = dir + (dir.back() == '/' ? "" : "/") + dp->d_name;
         unlink(rf.c_str());
     }
-    rmdir(dbname.c_str());
+    closedir(dirp);
+    rmdir(dir.c_str());
+}
+
+status DB::rebuild()
+{
+    char tmpname[] = "tmp.XXXXXX";
+    mktemp(tmpname);
+    {
+        wlock_t wlk(root_latch);
+        if (Rebuild) return status::error("The database is being rebuilt");
+        logger.check_point();
+        wait_if_check_point();
+        Rebuild = true;
+        wait_sync_point(true);
+    }
+    // 新的数据库要使用同样的比较器等选项，key才能按同样的顺序导入
+    DB *tmpdb = new DB(ops, tmpname);
+    int threads = ops.rebuild_threads;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    status s;
+    {
+        rlock_t rlk(root_latch);
+        s = tmpdb->bulk_load(partition_sources(threads));
+    }
+    delete tmpdb;
+    // 导入失败时丢弃新的数据库，旧的数据库仍然完好
+    if (!s.is_ok()) {
+        remove_dir(tmpname);
+        Rebuild = false;
+        return s;
+    }
+    remove_dir(dbname);
     rename(tmpname, dbname.c_str());
     init();
     Rebuild = false;
+    return status::ok();
 }
 
 } // namespace bpdb
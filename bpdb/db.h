@@ -9,9 +9,11 @@
 #include <errno.h>
 #include <assert.h>
 
+#include "io.h"
 #include "disk.h"
 #include "page.h"
 #include "log.h"
+#include "vlog.h"
 #include "transaction.h"
 
 namespace bpdb {
@@ -19,10 +21,15 @@ namespace bpdb {
 void panic(const char *fmt, ...);
 
 typedef std::function<bool(const key_t&, const key_t&)> Comparator;
+// bulk_load()的数据源，每次调用取出下一对key和value，没有更多数据时返回false
+typedef std::function<bool(std::string *key, std::string *value)> Source;
 
 struct options {
     int page_size = 1024 * 16;
     int page_cache_slots = 1024;
+    // 缓存节点所占内存的上限(bytes)，包括解码后的keys和values
+    // 不为0时将按字节数而非page_cache_slots来淘汰节点
+    size_t cache_bytes = 0;
     // 0: sync every log
     // 1: sync every `wal_sync_buffer_size`
     int wal_sync = 1;
@@ -31,6 +38,49 @@ struct options {
     int wal_wake_interval = 1;
     // 默认每10(s)做一次check-point
     int check_point_interval = 10;
+    // 每隔多久(ms)唤醒后台page-cleaner线程
+    int page_clean_interval = 100;
+    // 缓存中脏页的比例超过max_dirty_ratio时，page-cleaner会从最早变脏的页开始写回
+    // 这样check-point时就只剩下少量脏页需要刷盘了
+    double max_dirty_ratio = 0.1;
+    // 以O_DIRECT(Mac OS上为F_NOCACHE)打开数据文件，绕过内核的页缓存
+    // 这样translation_table就是唯一的缓存，内存占用也是可预期的
+    bool direct_io = false;
+    // 所有key都是8字节的大端整数(不能同时指定keycomp)
+    // 节点会额外保存一份连续的uint64_t数组，查找时直接比较整数
+    // 同一个数据库每次打开时都应使用相同的设置
+    bool int_keys = false;
+    // 超过limit.over_value的value追加到value-log中，而不是写入溢出页
+    // 叶节点只保存value的位置，大value的写入都是顺序的
+    bool value_log = false;
+    // 单个value-log文件的大小上限，写满后切换到新的文件
+    size_t value_log_file_size = 1024 * 1024 * 64;
+    // 一个value-log文件中的垃圾超过这个比例时，后台会将其中仍有效的value重新写入，然后删除它
+    double value_log_gc_ratio = 0.5;
+    // 每次check-point之后把文件末尾的节点挪到前面的空闲页中，然后截断文件，
+    // 并对中间较大的空闲区间打洞，将空间还给文件系统，而不必rebuild()
+    bool compaction = false;
+    // 每次check-point之后最多挪动的页数，挪动期间读写操作都会被阻塞
+    size_t compaction_pages = 1024;
+    // 每次check-point之后把key相邻却散落在文件各处的叶节点挪到连续的页中，
+    // 让叶节点在文件中的顺序与key的顺序一致，这样范围扫描就是顺序读了
+    bool recluster = false;
+    // 每次check-point之后重聚簇时最多挪动的页数
+    size_t recluster_pages = 1024;
+    // bulk_load()时每个节点最多填充到页大小的多少，留出的空间可以容纳之后的插入而不必立即分裂
+    double bulk_load_fill = 0.9;
+    // rebuild()时并行导入的线程数，为0时使用所有的CPU核
+    int rebuild_threads = 0;
+    // 插入后节点将超过页大小的split_fill时分裂，小于1时分裂出的节点都留有空闲空间
+    double split_fill = 1;
+    // 删除时节点小于页大小的merge_fill就向兄弟借用或与之合并
+    // merge_fill * 2 <= split_fill，这样合并后的节点不会立即又被分裂
+    double merge_fill = 0.5;
+    // 删除时不再在下降的路径上借用或合并，只记下不足merge_fill的叶节点，
+    // 由后台rebalancer线程每隔rebalance_interval(ms)统一处理
+    // 删除后又很快插入的负载就不必反复地合并和分裂了，代价是叶节点可能暂时不足半满甚至是空的
+    bool lazy_rebalance = false;
+    int rebalance_interval = 1000;
     Comparator keycomp;
 };
 
@@ -38,6 +88,8 @@ enum OpType {
     Insert = 1,
     Update = 2,
     Delete = 3,
+    // 覆盖value的一部分，只出现在wal中
+    Write = 4,
 };
 
 class DB {
@@ -49,35 +101,85 @@ public:
 
     class iterator {
     public:
-        iterator(DB *db) : db(db), page_id(0), i(0) {  }
-        ~iterator() { db->root_latch.unlock_shared(); }
+        iterator(DB *db) : db(db), page_id(0), i(0), x(nullptr) {  }
+        ~iterator()
+        {
+            if (x) x->unpin();
+            db->root_latch.unlock_shared();
+        }
         bool valid();
         const std::string& key();
         const std::string& value();
+        // 只读取当前value中从off开始的n个字节，见DB::read_range()
+        void read_range(size_t off, size_t n, std::string *value);
         iterator& seek(const std::string& key);
         iterator& seek_to_first();
         iterator& seek_to_last();
         iterator& next();
         iterator& prev();
     private:
+        node *get_node();
+        void set_page(page_id_t id);
+        void skip_empty(bool forward);
+
         DB *db;
         page_id_t page_id;
         int i;
+        // 当前所在的页，我们会一直pin住它，以保证key()和value()返回的引用有效
+        node *x;
+        std::string saved_key;
         std::string saved_value;
     };
 
     // 当你不再使用iterator的时候应该立即释放它
     // 避免长时间占有(read root_latch)
+    // iterator存在期间所有的修改操作(包括惰性重平衡)都会被阻塞，叶节点不会被合并或释放，
+    // 所以同一个线程不能在持有iterator时修改数据库
     iterator *new_iterator();
     status find(const std::string& key, std::string *value);
     status insert(const std::string& key, const std::string& value);
     status update(const std::string& key, const std::string& value);
     void erase(const std::string& key);
+    // 只读取value中从off开始的n个字节，对于很大的value，只有这部分所在的溢出页才会被读出
+    // off超出value末尾时读到的是空串
+    status read_range(const std::string& key, size_t off, size_t n, std::string *value);
+    // 用data覆盖value中从off开始的部分，off不能超出value的末尾，但data可以，这时value会变长
+    // 只覆盖叶节点中的部分时原地修改，否则就相当于update()整个value，溢出页都是写时复制的
+    status write_range(const std::string& key, size_t off, const std::string& data);
+    // 在value的末尾追加data
+    status append(const std::string& key, const std::string& data);
     // It is invalid after commit() or rollback() and you should delete it
     transaction *begin() { return trmgr.begin(); }
-    void rebuild();
+    // 从有序的source中批量导入数据，数据库必须是空的
+    // 叶节点从左到右依次填满，索引节点自底向上地构建，页也是顺序写入的，
+    // 每个key不再单独写wal，全部写完之后新的header落盘，导入就完成了
+    // 遇到无效的或无序的key时停止导入并返回错误，在它之前的key仍然会被导入
+    // 导入期间所有操作都会被阻塞
+    status bulk_load(const Source& source);
+    // 用bulk_load()将数据导入到一个新的数据库中，然后替换掉旧的数据库
+    // 导入失败时旧的数据库保持不变，并返回错误
+    status rebuild();
+    // 在下一次check-point时重聚簇所有叶节点，并等待它完成
+    // 调用者不能持有iterator，否则会一直等待下去
+    void recluster();
 private:
     void init();
+    status bulk_load(const std::vector<Source>& sources);
+    std::vector<Source> partition_sources(int n);
+    // 一个节点在树中的位置，parent为nullptr时就是根节点
+    struct page_ref {
+        page_id_t page_id;
+        node *parent;
+        int i;
+    };
+    // <节点的位置, 它要被挪到的页>
+    typedef std::vector<std::pair<page_ref, page_id_t>> page_moves;
+    bool lock_for_relocation();
+    void unlock_for_relocation(std::vector<node*>& pinned);
+    size_t collect_page_refs(std::vector<page_ref>& refs, std::vector<node*>& pinned);
+    void move_nodes(const page_moves& moves);
+    void compact(size_t max_pages);
+    bool recluster(size_t max_pages);
     void check_options();
     int open_db_file();
 
@@ -85,45 +187,65 @@ private:
     void wait_if_rebuild();
     void wait_sync_point(bool sync_rw_point);
 
-    bool is_main_thread() { return std::this_thread::get_id() == cur_tid; }
-    int get_db_fd() { return is_main_thread() ? fd : open_db_file(); }
-    void put_db_fd(int fd) { if (!is_main_thread()) close(fd); }
-
     void lock_header() { header_latch.lock(); }
     void unlock_header() { header_latch.unlock(); }
 
     node *to_node(page_id_t page_id) { return translation_table.to_node(page_id); }
     page_id_t to_page_id(node *node) { return translation_table.to_page_id(node); }
+    void release(node *x) { x->unlock(); x->unpin(); }
 
     int search(node *x, const key_t& key);
+    int search_packed(node *x, const key_t& key);
+    bool found(node *x, int i, const key_t& key);
+    const key_t& key_at(node *x, int i);
     status check_limit(const std::string& key, const std::string& value);
     value_t *build_new_value(const std::string& value, transaction *tx);
 
     std::pair<node*, int> find(node *x, const key_t& key);
     status insert(const std::string& key, const std::string& value, char op, transaction *tx);
+    status insert(const key_t& key, value_t *v, char op, transaction *tx);
     status insert(node *x, const key_t& key, value_t *value, char op, transaction *tx);
     void erase(const std::string& key, transaction *tx);
     void erase(node *x, const key_t& key, node *precursor, transaction *tx);
+    void erase_in_leaf(node *x, int i, const key_t& key, transaction *tx);
+    void lazy_erase(const key_t& key, transaction *tx);
+    void rebalance_handler();
+    void quit_rebalancer();
+    status write_range(const std::string& key, size_t off, const std::string& data, bool append);
+    value_t *write_range(node *x, int i, const key_t& key, size_t off, const std::string& data, bool append, status *s);
+    node *find_leaf(const key_t& key);
+    void relocate(const key_t& key, uint32_t file, uint64_t off);
 
     bool isfull(node *x, const key_t& key, value_t *value);
-    void split(node *x, int i, const key_t& key);
-    node *split(node *y, int type);
-    enum { RIGHT_INSERT_SPLIT, LEFT_INSERT_SPLIT, MID_SPLIT };
-    int get_split_type(node *x, const key_t& key);
+    size_t leaf_used_with(node *x, const key_t& key, value_t *value);
+    size_t leaf_used_merged(node *y, node *x);
+    size_t leaf_used_split(node *y, int from, int to, const key_t& key, value_t *value);
+    bool can_borrow(node *r, int j, node *x, node *y, int i);
+    bool can_merge(node *y, node *x);
+    void split(node *x, int i, const key_t& key, value_t *value);
+    node *split(node *y, int type, const key_t& key);
+    enum { RIGHT_INSERT_SPLIT, LEFT_INSERT_SPLIT, MID_SPLIT, ASCEND_SPLIT, DESCEND_SPLIT };
+    int get_split_type(node *x, const key_t& key, value_t *value);
+    int split_point(node *y, int type, const key_t& key);
+    key_t separator(node *y, int type, const key_t& key);
+    key_t shortest_separator(const key_t& l, const key_t& r);
     void link_leaf(node *z, node *y, int type);
-    void update_header_in_insert(node *x, const key_t& key);
+    void update_header_in_insert(node *x);
 
     node *get_precursor(node *x);
     void borrow_from_right(node *r, node *x, node *z, int i);
     void borrow_from_left(node *r, node *x, node *y, int i);
     void merge(node *y, node *x);
 
+    // 默认按字节比较时直接内联比较，不必通过std::function间接调用
     bool less(const key_t& l, const key_t& r)
     {
+        if (bytewise) return l < r;
         return comparator(l, r);
     }
     bool equal(const key_t& l, const key_t& r)
     {
+        if (bytewise) return l == r;
         return !comparator(l, r) && !comparator(r, l);
     }
 
@@ -139,15 +261,26 @@ private:
     options ops;
     std::string dbname;
     std::string dbfile;
-    std::thread::id cur_tid;
     // 每个线程执行修改操作时先递增sync_check_point，修改完成后再递减
     // 我们在做check_point()之前要保证sync_check_point=0，以保证刷脏页时数据库状态的一致性
     std::atomic_int sync_check_point = 0;
     std::atomic_int sync_read_point = 0;
     // 将要进行checkpoint，阻塞所有修改操作
     std::atomic_bool Checkpoint = false;
-    // 将要重建数据库，阻塞所有操作
+    // 将要重建或批量导入数据库，阻塞所有操作
     std::atomic_bool Rebuild = false;
+    // 下一次check-point时要重聚簇所有叶节点，见recluster()
+    std::atomic_bool Recluster = false;
+    // 由split_fill和merge_fill换算出的字节数
+    size_t split_bytes;
+    size_t merge_bytes;
+    // 惰性重平衡时等待处理的叶节点，以及删除时落在它上面的一个key，
+    // rebalancer沿着这个key再下降一次，就可以像以前那样借用或合并了
+    std::unordered_map<page_id_t, key_t> underfull;
+    std::mutex rebalance_mtx;
+    std::condition_variable rebalance_cv;
+    std::atomic_bool quit_rebalance = false;
+    std::thread rebalancer;
     header_t header;
     // 对header.page_size的并发访问是没有问题的，因为它不能在运行时更改
     std::recursive_mutex header_latch;
@@ -155,16 +288,22 @@ private:
     // 保护根节点，因为root本身可能会被修改，所以我们不能直接使用root->lock()
     // 那样是不安全的
     std::shared_mutex root_latch;
-    translation_table translation_table;
-    page_manager page_manager;
-    logger logger;
+    bpdb::page_io page_io;
+    bpdb::translation_table translation_table;
+    bpdb::page_manager page_manager;
+    bpdb::logger logger;
     transaction_manager trmgr;
+    value_log vlog;
     Comparator comparator;
+    // 没有指定keycomp时key按字节比较，这时分隔符可以被截短
+    bool bytewise;
     friend class translation_table;
     friend class page_manager;
     friend class logger;
     friend class transaction_manager;
     friend class transaction;
+    friend class value_log;
+    friend class bulk_loader;
 };
 }
 
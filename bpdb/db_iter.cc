@@ -2,34 +2,77 @@
 
 namespace bpdb {
 
+// 迭代器顺序扫描叶节点，不应冲掉缓存中的热点页
+node *DB::iterator::get_node()
+{
+    if (!x) x = db->translation_table.to_node(page_id, true);
+    return x;
+}
+
+void DB::iterator::set_page(page_id_t id)
+{
+    if (x) {
+        x->unpin();
+        x = nullptr;
+    }
+    page_id = id;
+}
+
+// 惰性重平衡时叶节点可能暂时是空的，迭代器要跳过它们
+void DB::iterator::skip_empty(bool forward)
+{
+    while (valid()) {
+        node *x = get_node();
+        rlock_t rlk(x->latch);
+        if (x->size() > 0) break;
+        page_id_t id = forward ? x->right : x->left;
+        rlk.unlock();
+        set_page(id);
+    }
+}
+
 bool DB::iterator::valid()
 {
     return page_id > 0;
 }
 
+// 我们只pin住了x，所以访问它时需要持有读锁，以免它同时被修改或解码
 const std::string& DB::iterator::key()
 {
-    node *x = db->to_node(page_id);
-    if (i == -1) i = x->keys.size() - 1;
-    return x->keys[i];
+    node *x = get_node();
+    rlock_t rlk(x->latch);
+    if (i == -1) i = x->size() - 1;
+    if (!x->packed) return x->keys[i];
+    x->packed_key(i, saved_key);
+    return saved_key;
 }
 
 const std::string& DB::iterator::value()
 {
-    node *x = db->to_node(page_id);
-    if (i == -1) i = x->keys.size() - 1;
-    value_t *v = x->values[i];
-    if (v->reallen <= limit.over_value) return *v->val;
-    db->translation_table.load_real_value(v, &saved_value);
+    node *x = get_node();
+    rlock_t rlk(x->latch);
+    if (i == -1) i = x->size() - 1;
+    if (!x->packed && x->values[i]->reallen <= limit.over_value) return *x->values[i]->val;
+    db->translation_table.read_value(x, i, &saved_value);
     return saved_value;
 }
 
+void DB::iterator::read_range(size_t off, size_t n, std::string *value)
+{
+    node *x = get_node();
+    rlock_t rlk(x->latch);
+    if (i == -1) i = x->size() - 1;
+    db->translation_table.read_range(x, i, off, n, value);
+}
+
 DB::iterator& DB::iterator::seek(const std::string& key)
 {
+    db->root->pin();
     db->root->lock_shared();
     auto [node, pos] = db->find(db->root.get(), key);
     if (node) {
-        page_id = db->to_page_id(node);
+        set_page(db->to_page_id(node));
+        x = node;
         i = pos;
         node->unlock_shared();
     }
@@ -39,38 +82,66 @@ DB::iterator& DB::iterator::seek(const std::string& key)
 DB::iterator& DB::iterator::seek_to_first()
 {
     if (db->header.key_nums > 0) {
-        page_id = db->header.leaf_id;
+        set_page(db->header.leaf_id);
         i = 0;
+        skip_empty(true);
     }
     return *this;
 }
 
+// 惰性重平衡时分隔符只是子树的上界，根节点的最后一个key可能已经被删除了，
+// 所以我们沿着最右边的路径找到最后一个叶节点
 DB::iterator& DB::iterator::seek_to_last()
 {
-    return seek(db->root->keys.back());
+    if (db->header.key_nums == 0) return *this;
+    page_id_t id = db->header.root_id;
+    while (true) {
+        node *x = db->translation_table.to_node(id);
+        rlock_t rlk(x->latch);
+        bool leaf = x->leaf;
+        page_id_t child = leaf ? 0 : x->child(x->size() - 1);
+        rlk.unlock();
+        x->unpin();
+        if (leaf) break;
+        id = child;
+    }
+    set_page(id);
+    i = -1;
+    skip_empty(false);
+    return *this;
 }
 
 DB::iterator& DB::iterator::next()
 {
-    node *x = db->to_node(page_id);
-    if (i == -1) i = x->keys.size() - 1;
-    if (i + 1 < x->keys.size()) i++;
-    else {
-        page_id = x->right;
+    {
+        node *x = get_node();
+        rlock_t rlk(x->latch);
+        if (i == -1) i = x->size() - 1;
+        if (i + 1 < x->size()) {
+            i++;
+            return *this;
+        }
+        set_page(x->right);
         i = 0;
     }
+    skip_empty(true);
     return *this;
 }
 
 DB::iterator& DB::iterator::prev()
 {
-    node *x = db->to_node(page_id);
-    if (i == -1) i = x->keys.size() - 1;
-    if (i - 1 >= 0) i--;
-    else {
-        page_id = x->left;
+    {
+        node *x = get_node();
+        rlock_t rlk(x->latch);
+        if (i == -1) i = x->size() - 1;
+        if (i - 1 >= 0) {
+            i--;
+            return *this;
+        }
+        set_page(x->left);
         i = -1;
     }
+    skip_empty(false);
     return *this;
 }
 
@@ -1,5 +1,4 @@
 #include <sys/stat.h>
-#include <sys/mman.h>
 
 #include "db.h"
 #include "codec.h"
@@ -7,6 +6,30 @@
 
 namespace bpdb {
 
+// 缓存被划分的shard数
+static const int cache_shards = 16;
+// page-cleaner每次最多写回的页数
+static const size_t max_clean_pages = 256;
+// check-point时每批写入的页数
+static const size_t max_flush_pages = 1024;
+// 缓存满了却没有干净的页可以淘汰时，每次最多写回的脏页数
+static const size_t max_write_back_pages = 16;
+
+static std::atomic<uint64_t> dirty_seq(0);
+
+translation_table::translation_table(DB *db) : db(db), cache_cap(1024), cache_bytes(0), quit_cleaner(false)
+{
+    shards.resize(cache_shards);
+    for (int i = 0; i < cache_shards; i++)
+        shards[i].reset(new cache_shard());
+}
+
+translation_table::~translation_table()
+{
+    quit_page_cleaner();
+    if (journal_fd >= 0) close(journal_fd);
+}
+
 void translation_table::init()
 {
     clear();
@@ -15,99 +38,454 @@ void translation_table::init()
 
 void translation_table::clear()
 {
-    translation_to_node.clear();
-    translation_to_page.clear();
-    cache_list.clear();
+    // 不能在page-cleaner扫描的过程中清空缓存
+    lock_t lk(page_cleaner_mtx);
+    for (auto& shard : shards) {
+        shard->pages.clear();
+        shard->clock.clear();
+        shard->hand = shard->clock.end();
+        shard->bytes = 0;
+    }
 }
 
-node *translation_table::lru_get(page_id_t page_id)
+translation_table::cache_shard& translation_table::get_shard(page_id_t page_id)
 {
-    wlock_t wlk(table_latch);
-    auto it = translation_to_node.find(page_id);
-    if (it == translation_to_node.end()) return nullptr;
-    if (it->second.pos != cache_list.begin()) {
-        cache_list.erase(it->second.pos);
-        cache_list.push_front(it->first);
-        it->second.pos = cache_list.begin();
-    }
+    return *shards[(page_id / db->header.page_size) % cache_shards];
+}
+
+node *translation_table::cache_get(page_id_t page_id, bool scan)
+{
+    auto& shard = get_shard(page_id);
+    rlock_t rlk(shard.latch);
+    auto it = shard.pages.find(page_id);
+    if (it == shard.pages.end()) return nullptr;
+    auto& ref = it->second.ref;
+    // 避免无谓的写，以减少多核之间的缓存行争用
+    if (!scan && !ref.load(std::memory_order_relaxed))
+        ref.store(true, std::memory_order_relaxed);
+    recharge(shard, it->second);
+    // 必须在持有shard.latch的情况下pin，这样evict()看到的pins才是可靠的
+    it->second.x->pin();
     return it->second.x.get();
 }
 
-void translation_table::lru_put(page_id_t page_id, node *node)
+// 节点被修改后大小会变化，我们只在访问它时才修正shard.bytes
+// 这只需持有shard.latch的读锁
+void translation_table::recharge(cache_shard& shard, cache_node& e)
 {
-    wlock_t wlk(table_latch);
-    if (translation_to_node.count(page_id)) return;
-    if (cache_list.size() >= lru_cap) {
-        page_id_t evict_page_id = cache_list.back();
-        auto *evict_node = translation_to_node[evict_page_id].x.get();
-        if (evict_node->latch.try_lock()) {
-            if (!evict_node->deleted && !evict_node->dirty && !evict_node->maybe_using) {
-                translation_to_page.erase(evict_node);
-                translation_to_node.erase(evict_page_id);
-                cache_list.pop_back();
-            } else {
+    size_t mem_used = e.x->mem_used.load(std::memory_order_relaxed);
+    size_t charge = e.charge.load(std::memory_order_relaxed);
+    if (mem_used != charge && e.charge.compare_exchange_strong(charge, mem_used)) {
+        shard.bytes += mem_used - charge;
+    }
+}
+
+bool translation_table::need_evict(cache_shard& shard)
+{
+    if (cache_bytes > 0)
+        return shard.bytes >= cache_bytes / cache_shards;
+    size_t cap = cache_cap;
+    return shard.pages.size() >= (cap + cache_shards - 1) / cache_shards;
+}
+
+// 返回缓存中page_id对应的节点，它可能是之前已经存在的
+node *translation_table::cache_put(page_id_t page_id, node *node, bool pin, bool scan)
+{
+    bool full = false;
+    std::vector<std::pair<uint64_t, struct node*>> victims;
+    auto& shard = get_shard(page_id);
+    {
+        wlock_t wlk(shard.latch);
+        auto it = shard.pages.find(page_id);
+        if (it != shard.pages.end()) {
+            if (pin) it->second.x->pin();
+            return it->second.x.get();
+        }
+        // 按字节淘汰时，淘汰一个节点可能还不够
+        while (need_evict(shard) && evict(shard))
+            ;
+        full = need_evict(shard);
+        // 剩下的都是脏页或正在使用的页，就挑出一批脏页，在释放shard.latch之后写回
+        if (full) dirty_victims(shard, victims);
+        // 新页插到hand之前，即hand转一圈之后才会检查到它
+        // 扫描加载的页则放在hand处，它会是下一个被淘汰的
+        auto& e = shard.pages[page_id];
+        e.x.reset(node);
+        e.pos = shard.clock.insert(shard.hand, page_id);
+        if (scan) shard.hand = e.pos;
+        e.charge = node->mem_used.load();
+        shard.bytes += e.charge;
+        node->page_id = page_id;
+        if (pin) node->pin();
+    }
+    if (!full) return node;
+    // 写回之后它们就是干净的了，这样缓存最多只会暂时超出几个页
+    if (!victims.empty()) {
+        bool written = write_back(victims);
+        for (auto& [dirtied, x] : victims) {
+            x->unpin();
+        }
+        if (written) {
+            wlock_t wlk(shard.latch);
+            while (need_evict(shard) && evict(shard))
+                ;
+        }
+    }
+    // 让page-cleaner尽快写回更多的脏页
+    page_cleaner_cv.notify_one();
+    return node;
+}
+
+// CLOCK(second-chance)：
+// hand扫过时如果访问位被设置，就清除它并跳过，否则就尝试淘汰该页
+// 为了避免在都无法淘汰的情况下一直转圈，我们最多扫描两圈
+//
+// 被pin住的或已删除的节点不能被淘汰，脏节点要先由cache_put()或page-cleaner写回，见write_back()
+//
+// 如果淘汰了一个节点就返回true
+bool translation_table::evict(cache_shard& shard)
+{
+    size_t n = shard.clock.size() * 2;
+    for (size_t i = 0; i < n; i++) {
+        if (shard.hand == shard.clock.end())
+            shard.hand = shard.clock.begin();
+        auto& e = shard.pages[*shard.hand];
+        recharge(shard, e);
+        if (e.ref.load(std::memory_order_relaxed)) {
+            e.ref.store(false, std::memory_order_relaxed);
+            ++shard.hand;
+            continue;
+        }
+        auto *evict_node = e.x.get();
+        if (evict_node->pins > 0 || evict_node->deleted) {
+            ++shard.hand;
+            continue;
+        }
+        if (!evict_node->dirty && evict_node->latch.try_lock()) {
+            if (!evict_node->dirty) {
+                page_id_t page_id = *shard.hand;
+                shard.hand = shard.clock.erase(shard.hand);
+                shard.bytes -= e.charge;
                 evict_node->unlock();
+                shard.pages.erase(page_id);
+                return true;
             }
+            evict_node->unlock();
         }
+        ++shard.hand;
     }
-    cache_list.push_front(page_id);
-    translation_to_node.emplace(page_id, cache_node(node, cache_list.begin()));
-    translation_to_page.emplace(node, page_id);
+    return false;
 }
 
-node *translation_table::to_node(page_id_t page_id)
+// 从hand开始挑出至多max_write_back_pages个可以写回的脏页，调用者需持有shard.latch
+// 挑出的节点会被pin住，以免写回之前就被淘汰或释放
+void translation_table::dirty_victims(cache_shard& shard, std::vector<std::pair<uint64_t, node*>>& victims)
 {
-    if (page_id == db->header.root_id) return db->root.get();
-    node *node = lru_get(page_id);
-    if (node == nullptr) {
-        node = load_node(page_id);
-        lru_put(page_id, node);
+    auto it = shard.hand;
+    for (size_t i = 0; i < shard.clock.size() && victims.size() < max_write_back_pages; i++, ++it) {
+        if (it == shard.clock.end()) it = shard.clock.begin();
+        node *x = shard.pages[*it].x.get();
+        if (x->pins > 0 || x->deleted || !x->dirty) continue;
+        x->pin();
+        victims.emplace_back(x->dirtied, x);
     }
-    node->maybe_using = true;
-    return node;
+}
+
+// 恢复时是在上一次check-point的镜像上重放逻辑的wal，如果分裂后的左节点先于它的兄弟和父节点落盘，
+// 被挪走的key就不在镜像中了，而wal中也没有它们，所以脏页不能直接覆盖磁盘上的页
+// 我们先把每个页在check-point时的内容追加到journal中并落盘，然后才写回节点，
+// 崩溃后recover()会用journal把这些页还原，数据文件就又是上一次check-point时的镜像了
+//
+// nodes中的节点由调用者pin住，并在返回之后unpin，写入完成之前它们都不能被淘汰，
+// 否则之后又会从磁盘读到旧的页
+// 一个节点只有在挑出它之后没有再次变脏(dirtied不变)时才会被写回
+// 正在被修改的节点、还有大value未写入溢出页或value-log的节点(见has_pending_values())都会被跳过，
+// check-point期间flush()一直持有journal_mtx，这时什么也不做
+// 写回了至少一个节点时返回true
+bool translation_table::write_back(std::vector<std::pair<uint64_t, node*>>& nodes)
+{
+    std::unique_lock<std::mutex> jlk(journal_mtx, std::try_to_lock);
+    if (!jlk.owns_lock()) return false;
+    std::vector<page_write> pages;
+    for (auto& [dirtied, node] : nodes) {
+        // 调用者可能持有其他节点的latch，所以这里不能阻塞
+        if (!node->latch.try_lock()) continue;
+        if (node->dirty && node->dirtied == dirtied && !node->deleted && !has_pending_values(node)) {
+            pages.emplace_back();
+            pages.back().page_id = node->page_id;
+            encode_node(pages.back().buf, node);
+            node->dirty = false;
+        }
+        node->unlock();
+    }
+    if (pages.empty()) return false;
+    // 我们必须保证wal先于数据落盘
+    // 修改节点前总是先持有它的latch再写wal，所以在编码完这些节点之后再flush_wal()，
+    // 就能保证编码进去的所有修改对应的wal都已落盘
+    db->logger.flush_wal(true);
+    journal(pages);
+    db->page_io.write_pages(pages);
+    return true;
+}
+
+// 节点中是否有还未写入溢出页或value-log的大value
+bool translation_table::has_pending_values(node *node)
+{
+    if (node->packed || !node->leaf) return false;
+    for (auto value : node->values) {
+        if (value->reallen <= limit.over_value) continue;
+        if (value->in_vlog() ? value->vlog_file == 0 : value->over_page_id == 0) return true;
+    }
+    return false;
+}
+
+// 把pages在check-point时的内容追加到journal中并落盘，调用者需持有journal_mtx
+void translation_table::journal(const std::vector<page_write>& pages)
+{
+    size_t page_size = db->header.page_size;
+    std::string buf;
+    page_frame frame(db->page_io);
+    for (auto& page : pages) {
+        if (page.page_id >= image_end || journaled.count(page.page_id)) continue;
+        db->page_io.read_page(page.page_id, frame.data());
+        encode_page_id(buf, page.page_id);
+        buf.append(frame.data(), page_size);
+        journaled.insert(page.page_id);
+    }
+    if (buf.empty()) return;
+    if (pwrite(journal_fd, buf.data(), buf.size(), journal_size) != (ssize_t)buf.size()) {
+        panic("journal: write(%s): %s", (db->dbname + "journal").c_str(), strerror(errno));
+    }
+    journal_size += buf.size();
+    sync_fd(journal_fd);
+}
+
+void translation_table::journal(page_id_t page_id)
+{
+    std::vector<page_write> pages(1);
+    pages[0].page_id = page_id;
+    journal(pages);
+}
+
+// 新的header落盘之后，之前的journal就没用了，调用者需持有journal_mtx
+void translation_table::reset_journal()
+{
+    std::string buf;
+    encode64(buf, db->header.check_point_seq);
+    if (ftruncate(journal_fd, 0) < 0 || pwrite(journal_fd, buf.data(), buf.size(), 0) != (ssize_t)buf.size()) {
+        panic("journal: reset(%s): %s", (db->dbname + "journal").c_str(), strerror(errno));
+    }
+    journal_size = buf.size();
+    journaled.clear();
+    image_end = db->header.free_list_head;
+}
+
+// 只有和header属于同一次check-point的journal才需要还原，
+// 如果新的header已经落盘而journal还没来得及清空，它就是上一次的，直接丢弃即可
+void translation_table::recover()
+{
+    auto name = db->dbname + "journal";
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        panic("open(%s): %s", name.c_str(), strerror(errno));
+    }
+    struct stat st;
+    fstat(journal_fd, &st);
+    std::string buf(st.st_size, 0);
+    if (read(journal_fd, &buf[0], buf.size()) != (ssize_t)buf.size()) {
+        panic("journal: read(%s): %s", name.c_str(), strerror(errno));
+    }
+    size_t page_size = db->header.page_size;
+    size_t record_size = sizeof(page_id_t) + page_size;
+    char *ptr = &buf[0];
+    char *end = ptr + buf.size();
+    if (buf.size() >= sizeof(uint64_t) && decode64(&ptr) == db->header.check_point_seq) {
+        page_frame frame(db->page_io);
+        // 最后一个记录可能只写了一部分，那么它对应的页一定还没有被覆盖
+        while ((size_t)(end - ptr) >= record_size) {
+            page_id_t page_id = decode_page_id(&ptr);
+            memcpy(frame.data(), ptr, page_size);
+            ptr += page_size;
+            db->page_io.write_page(page_id, frame.data());
+        }
+        sync_fd(db->fd);
+    }
+    lock_t lk(journal_mtx);
+    reset_journal();
+}
+
+void translation_table::start_page_cleaner()
+{
+    if (page_cleaner.joinable()) return;
+    quit_cleaner = false;
+    page_cleaner = std::thread([this]{ this->page_clean_handler(); });
+}
+
+void translation_table::quit_page_cleaner()
+{
+    quit_cleaner = true;
+    page_cleaner_cv.notify_one();
+    if (page_cleaner.joinable())
+        page_cleaner.join();
+}
+
+void translation_table::page_clean_handler()
+{
+    while (!quit_cleaner) {
+        std::unique_lock<std::mutex> ulock(page_cleaner_mtx);
+        page_cleaner_cv.wait_for(ulock, std::chrono::milliseconds(db->ops.page_clean_interval));
+        if (quit_cleaner) break;
+        // check-point会自己刷盘，重建时缓存则会被清空
+        if (db->Checkpoint || db->Rebuild) continue;
+        clean_pages();
+    }
+}
+
+// 如果脏页的比例超过了max_dirty_ratio，就从最早变脏的页开始写回，
+// 直到比例降到max_dirty_ratio以下，每次最多写回max_clean_pages个页
+// 这样check-point时就只剩下少量脏页需要刷盘了，写回的方式和淘汰时一样，见write_back()
+void translation_table::clean_pages()
+{
+    std::vector<std::pair<uint64_t, node*>> dirty_pages;
+    size_t total_pages = 0;
+    for (auto& shard : shards) {
+        rlock_t rlk(shard->latch);
+        total_pages += shard->pages.size();
+        for (auto& [page_id, e] : shard->pages) {
+            node *node = e.x.get();
+            if (node->dirty && !node->deleted) {
+                node->pin();
+                dirty_pages.emplace_back(node->dirtied, node);
+            }
+        }
+    }
+    size_t max_dirty_pages = total_pages * db->ops.max_dirty_ratio;
+    if (dirty_pages.size() > max_dirty_pages) {
+        size_t n = std::min(dirty_pages.size() - max_dirty_pages, max_clean_pages);
+        std::nth_element(dirty_pages.begin(), dirty_pages.begin() + (n - 1), dirty_pages.end());
+        std::sort(dirty_pages.begin(), dirty_pages.begin() + n, [](const auto& l, const auto& r) {
+            return l.second->page_id < r.second->page_id;
+        });
+        std::vector<std::pair<uint64_t, node*>> victims(dirty_pages.begin(), dirty_pages.begin() + n);
+        write_back(victims);
+    }
+    for (auto& [dirtied, node] : dirty_pages) {
+        node->unpin();
+    }
+}
+
+// 从shard中移除page_id，调用者需持有shard.latch
+void translation_table::erase(cache_shard& shard, page_id_t page_id)
+{
+    auto it = shard.pages.find(page_id);
+    if (shard.hand == it->second.pos) ++shard.hand;
+    shard.clock.erase(it->second.pos);
+    shard.bytes -= it->second.charge;
+    shard.pages.erase(it);
+}
+
+node *translation_table::to_node(page_id_t page_id, bool scan)
+{
+    if (page_id == db->header.root_id) {
+        db->root->pin();
+        return db->root.get();
+    }
+    node *node = cache_get(page_id, scan);
+    if (node) return node;
+    // 如果并发加载同一页，那么在一个线程读盘之后、放入缓存之前，
+    // 另一个线程加载的那一份可能已经被修改、写回并淘汰掉了，
+    // 这样放入缓存的就会是一个旧的页
+    lock_t lk(get_shard(page_id).load_latch);
+    node = cache_get(page_id, scan);
+    if (node) return node;
+    return cache_put(page_id, load_node(page_id), true, scan);
 }
 
 page_id_t translation_table::to_page_id(node *node)
 {
     if (node == db->root.get()) return db->header.root_id;
-    rlock_t rlock(table_latch);
-    auto it = translation_to_page.find(node);
-    if (it == translation_to_page.end()) {
+    if (node->page_id == 0) {
         panic("to_page_id(%p)", node);
     }
-    return it->second;
+    return node->page_id;
 }
 
 void translation_table::flush()
 {
+    // 等待正在进行的page-cleaner结束
+    lock_t lk(page_cleaner_mtx);
+    // 等待正在进行的写回结束，之后直到新的header落盘都不会再有写回了
+    lock_t jlk(journal_mtx);
+    std::vector<node*> dirty_nodes;
     std::vector<node*> del_nodes;
-    {
-        rlock_t rlk(table_latch);
-        for (auto& [node, page_id] : translation_to_page) {
+    for (auto& shard : shards) {
+        rlock_t rlk(shard->latch);
+        for (auto& [page_id, e] : shard->pages) {
+            node *node = e.x.get();
             if (node->deleted) {
-                del_nodes.push_back(node);
-                continue;
+                // 被pin住的节点可能正在被写回，我们留到下一次check-point再释放它
+                if (node->pins == 0) del_nodes.push_back(node);
+            } else if (node->dirty) {
+                node->pin();
+                dirty_nodes.push_back(node);
             }
+        }
+    }
+    // 此时所有修改操作都已被阻塞，但可能还有读操作持有节点的读锁
+    // 我们按page_id顺序分批编码，然后一次性写入一批，相邻的页会被合并写入
+    std::sort(dirty_nodes.begin(), dirty_nodes.end(), [](node *l, node *r) {
+        return l->page_id < r->page_id;
+    });
+    for (size_t i = 0; i < dirty_nodes.size(); i += max_flush_pages) {
+        size_t end = std::min(dirty_nodes.size(), i + max_flush_pages);
+        std::vector<page_write> pages;
+        pages.reserve(end - i);
+        for (size_t j = i; j < end; j++) {
+            node *node = dirty_nodes[j];
+            // 刷盘不需要解码节点
+            node->latch.lock();
             if (node->dirty) {
-                save_node(page_id, node);
+                pages.emplace_back();
+                pages.back().page_id = node->page_id;
+                encode_node(pages.back().buf, node);
                 node->dirty = false;
             }
-            node->maybe_using = false;
+            node->unlock();
+        }
+        // 节点引用的value必须先于节点落盘
+        if (db->ops.value_log) db->vlog.sync();
+        // 新的header落盘之前崩溃的话，这些页也要能还原成上一次check-point时的内容
+        journal(pages);
+        db->page_io.write_pages(pages);
+        // 写入之前不能unpin，否则节点可能会被淘汰，之后又从磁盘读到旧的页
+        for (size_t j = i; j < end; j++) {
+            dirty_nodes[j]->unpin();
         }
     }
     for (auto node : del_nodes) {
-        free_node(translation_to_page[node], node);
+        free_node(node->page_id, node);
     }
     // 就算什么也没做，我们也强制flush一次根节点
     // 以便重启后可以成功load根节点
-    save_node(db->header.root_id, db->root.get());
+    std::vector<page_write> root(1);
+    root[0].page_id = db->header.root_id;
+    encode_node(root[0].buf, db->root.get());
+    if (db->ops.value_log) db->vlog.sync();
+    journal(root);
+    db->page_io.write_pages(root);
+    db->page_manager.check_point();
+    // 新的header落盘之后journal就作废了，所以页必须先于header落盘
+    sync_fd(db->fd);
     save_header(&db->header);
     sync_fd(db->fd);
+    reset_journal();
+    db->vlog.check_point();
 }
 
 // ########################### file-header ###########################
 // [magic][page-size][key-nums][root-id][leaf-id]
-// [free-list-head][free-pages][over-page-list-head][over-pages]
+// [free-list-head][free-pages][over-page-list-head][over-pages][check-point-seq][int-keys]
 void translation_table::fill_header(header_t *header, struct iovec *iov)
 {
     iov[0].iov_base = &header->magic;
@@ -128,16 +506,23 @@ void translation_table::fill_header(header_t *header, struct iovec *iov)
     iov[7].iov_len = sizeof(header->over_page_list_head);
     iov[8].iov_base = &header->over_pages;
     iov[8].iov_len = sizeof(header->over_pages);
+    iov[9].iov_base = &header->check_point_seq;
+    iov[9].iov_len = sizeof(header->check_point_seq);
+    iov[10].iov_base = &header->int_keys;
+    iov[10].iov_len = sizeof(header->int_keys);
 }
 
-#define HEADER_IOV_LEN 9
+#define HEADER_IOV_LEN 11
 
 void translation_table::save_header(header_t *header)
 {
     struct iovec iov[HEADER_IOV_LEN];
     fill_header(header, iov);
-    lseek(db->fd, 0, SEEK_SET);
-    writev(db->fd, iov, HEADER_IOV_LEN);
+    std::string buf;
+    for (int i = 0; i < HEADER_IOV_LEN; i++) {
+        buf.append(reinterpret_cast<char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+    db->page_io.write(0, buf.data(), buf.size());
 }
 
 void translation_table::load_header()
@@ -145,56 +530,185 @@ void translation_table::load_header()
     int8_t magic;
     struct stat st;
     fstat(db->fd, &st);
-    if (st.st_size == 0) return;
-    read(db->fd, &magic, sizeof(magic));
-    if (magic != db->header.magic) {
-        panic("unknown data file <%s>", db->dbfile.c_str());
+    // 新的数据文件先写入header，这样第一次check-point之前写回的页后面就不会没有header了
+    if (st.st_size == 0) {
+        save_header(&db->header);
+        sync_fd(db->fd);
+        return;
     }
     struct iovec iov[HEADER_IOV_LEN];
     fill_header(&db->header, iov);
-    lseek(db->fd, 0, SEEK_SET);
-    readv(db->fd, iov, HEADER_IOV_LEN);
+    size_t len = 0;
+    for (int i = 0; i < HEADER_IOV_LEN; i++) len += iov[i].iov_len;
+    std::string buf(len, 0);
+    db->page_io.read(0, &buf[0], len);
+    char *ptr = &buf[0];
+    magic = decode8(&ptr);
+    if (magic == 0x1a) {
+        panic("data file <%s> has an older incompatible page format", db->dbfile.c_str());
+    }
+    if (magic != db->header.magic) {
+        panic("unknown data file <%s>", db->dbfile.c_str());
+    }
+    ptr = &buf[0];
+    for (int i = 0; i < HEADER_IOV_LEN; i++) {
+        memcpy(iov[i].iov_base, ptr, iov[i].iov_len);
+        ptr += iov[i].iov_len;
+    }
+    // 节点中的ikeys是按8字节的key解码的，设置不一致时会越界读取
+    if (db->header.int_keys != db->ops.int_keys) {
+        panic("data file <%s> was created with `int_keys` = %s", db->dbfile.c_str(),
+              db->header.int_keys ? "true" : "false");
+    }
+}
+
+// string的内容不在SSO缓冲区内时才会额外占用堆内存
+// 我们假定SSO缓冲区位于string对象内部(libstdc++、libc++和MSVC都是如此)，
+// 所以只需看data()是否指向对象自身，而不必知道各个实现的SSO容量
+static size_t heap_size(const std::string& s)
+{
+    auto *p = reinterpret_cast<const char*>(&s);
+    if (s.data() >= p && s.data() < p + sizeof(s)) return 0;
+    return s.capacity() + 1;
 }
 
 void node::update(bool dirty)
 {
-    page_used = limit.type_field + limit.key_nums_field;
-    for (auto& key : keys) page_used += limit.key_len_field + key.size();
-    if (leaf) {
-        for (auto& value : values)  {
-            page_used += limit.value_len_field + sizeof(trx_id_t) + std::min(limit.over_value, (size_t)value->reallen);
+    last_insert = -1;
+    size_t mem = sizeof(node) + heap_size(page);
+    if (!packed) {
+        prefix = key_prefix();
+        page_used = limit.type_field + limit.key_nums_field + limit.prefix_len_field + prefix;
+        mem += keys.capacity() * sizeof(key_t);
+        for (auto& key : keys) {
+            page_used += limit.slot_field + limit.key_len_field + key.size() - prefix;
+            mem += heap_size(key);
+        }
+        if (leaf) {
+            mem += values.capacity() * sizeof(value_t*);
+            for (auto& value : values)  {
+                page_used += value->page_used();
+                mem += sizeof(value_t) + sizeof(std::string) + heap_size(*value->val);
+            }
+            page_used += sizeof(page_id_t) * 2;
+        } else {
+            mem += childs.capacity() * sizeof(page_id_t);
+            page_used += sizeof(page_id_t) * childs.size();
         }
-        page_used += sizeof(page_id_t) * 2;
-    } else {
-        page_used += sizeof(page_id_t) * childs.size();
     }
-    this->dirty = dirty;
+    if (limit.int_keys) {
+        update_ikeys();
+        mem += ikeys.capacity() * sizeof(uint64_t);
+    }
+    mem_used.store(mem, std::memory_order_relaxed);
+    if (dirty) mark_dirty();
+    else this->dirty = false;
+}
+
+void node::update_ikeys()
+{
+    int n = size();
+    ikeys.resize(n);
+    if (!packed) {
+        for (int i = 0; i < n; i++) {
+            check_int_key(keys[i]);
+            ikeys[i] = decode_be64(keys[i].data());
+        }
+        return;
+    }
+    key_t key; // 8字节的key不会分配内存
+    for (int i = 0; i < n; i++) {
+        packed_key(i, key);
+        check_int_key(key);
+        ikeys[i] = decode_be64(key.data());
+    }
+}
+
+// 从磁盘读到的key不一定经过了check_limit()，不是8字节时decode_be64()就会越界
+void node::check_int_key(const key_t& key)
+{
+    if (key.size() != limit.int_key_len) {
+        panic("node %lld: key of %zu bytes with `int_keys`", page_id, key.size());
+    }
+}
+
+// 叶节点中所有key的公共前缀的长度
+// 索引节点中的key在分裂、合并时会被替换掉，这可能会让前缀变短，而父节点却不一定放得下，
+// 所以它们不做前缀压缩
+size_t node::key_prefix() const
+{
+    if (!leaf || keys.empty()) return 0;
+    size_t n = keys[0].size();
+    for (size_t i = 1; i < keys.size() && n > 0; i++) {
+        n = std::min(n, common_prefix(keys[0], keys[i]));
+    }
+    return n;
+}
+
+void node::mark_dirty()
+{
+    if (!dirty) dirtied = ++dirty_seq;
+    dirty = true;
 }
 
 void translation_table::save_node(page_id_t page_id, node *node)
 {
     std::string buf;
+    encode_node(buf, node);
+    // 节点引用的value必须先于节点落盘
+    if (db->ops.value_log) db->vlog.sync();
+    // 如果没有写满一页的话，也不会有什么问题，文件空洞是允许的
+    db->page_io.write(page_id, buf.data(), buf.size());
+}
+
+// ########################### node-page ###########################
+// 节点页采用slotted-page格式，slot是对应记录在页内的偏移
+// 记录按key的顺序依次存放在slots之后的heap中，这样查找时只需在slots上二分
+// +-------------------------------------------------------------------------------------+
+// | 1 byte | 2 bytes  | 8 bytes | 8 bytes |   1 byte   |        | 2 bytes * key-nums |     |
+// |  leaf  | key-nums |  left   |  right  | prefix-len | prefix |       slots        | ... |
+// +-------------------------------------------------------------------------------------+
+// 索引节点没有left和right，prefix-len总是0
+// 叶节点的记录: [key-len][key-suffix][value]
+// 索引节点的记录: [key-len][key][child-page-id]
+// 叶节点中的key只保存去掉公共前缀之后的部分，key-len也是后缀的长度
+void translation_table::encode_node(std::string& buf, node *node)
+{
+    if (node->packed) {
+        // 未被修改过的节点只有left和right可能会变
+        buf.assign(node->page);
+        if (node->leaf) {
+            size_t off = limit.type_field + limit.key_nums_field;
+            memcpy(&buf[off], &node->left, sizeof(node->left));
+            memcpy(&buf[off + sizeof(page_id_t)], &node->right, sizeof(node->right));
+        }
+        return;
+    }
+    int n = node->keys.size();
+    size_t prefix = node->key_prefix();
     buf.reserve(node->page_used);
     encode8(buf, node->leaf);
-    encode16(buf, node->keys.size());
-    for (auto& key : node->keys) {
-        encode8(buf, key.size());
-        buf.append(key);
-    }
+    encode16(buf, n);
     if (node->leaf) {
-        for (auto& value : node->values) {
-            save_value(buf, value);
-        }
         encode_page_id(buf, node->left);
         encode_page_id(buf, node->right);
-    } else {
-        for (auto& child_page_id : node->childs) {
-            encode_page_id(buf, child_page_id);
-        }
     }
-    lseek(db->fd, page_id, SEEK_SET);
-    // 如果没有写满一页的话，也不会有什么问题，文件空洞是允许的
-    write(db->fd, buf.data(), buf.size());
+    encode8(buf, prefix);
+    if (n > 0) buf.append(node->keys[0], 0, prefix);
+    size_t slots = buf.size();
+    buf.resize(slots + n * limit.slot_field);
+    for (int i = 0; i < n; i++) {
+        uint16_t off = buf.size();
+        memcpy(&buf[slots + i * limit.slot_field], &off, sizeof(off));
+        auto& key = node->keys[i];
+        encode8(buf, key.size() - prefix);
+        buf.append(key, prefix);
+        if (node->leaf) save_value(buf, key, node->values[i]);
+        else encode_page_id(buf, node->childs[i]);
+    }
+    if (buf.size() > db->header.page_size) {
+        panic("encode_node: page overflow (%zu > %zu)", buf.size(), db->header.page_size);
+    }
 }
 
 #define CAP_OF_OVER_PAGE (db->header.page_size - sizeof(page_id_t))
@@ -202,26 +716,58 @@ void translation_table::save_node(page_id_t page_id, node *node)
 
 #define OVER_VALUE_LEN (limit.over_value - sizeof(page_id_t) - 2)
 
+// value-header见codec.h中的encode_value_header()
+//
 // if value->reallen <= limit.over_value
-// +----------------------------------------+
-// |  4 bytes  | 8 bytes | limit.over_value |
-// | value-len | trx-id  |       value      |
-// +----------------------------------------+
+// +---------------------------------+
+// | value-header | limit.over_value |
+// |              |       value      |
+// +---------------------------------+
+// else if in-vlog:
+// +-------------------------------------------+
+// | value-header |   4 bytes   |   8 bytes    |
+// |              | vlog-file   | vlog-offset  |
+// +-------------------------------------------+
 // else:
-// +-----------------------------------------------------------------------+
-// |  4 bytes  | 8 bytes |   8 bytes    | 2 bytes  | limit.over_value - 10 |
-// | value-len | trx-id  | over-page-id | page-off |        value          |
-// +-----------------------------------------------------------------------+
+// +----------------------------------------------------------------+
+// | value-header |   8 bytes    | 2 bytes  | limit.over_value - 10 |
+// |              | over-page-id | page-off |        value          |
+// +----------------------------------------------------------------+
 // over-page: [next-over-page-id][data]
-void translation_table::save_value(std::string& buf, value_t *value)
+#define VLOG_PTR_LEN (sizeof(uint32_t) + sizeof(uint64_t))
+
+// 已经写入溢出页的value仍保留在溢出页中，新的大value才会写入value-log
+bool value_t::in_vlog() const
+{
+    if (vlog_file > 0) return true;
+    return limit.value_log && over_page_id == 0 && reallen > limit.over_value;
+}
+
+size_t value_t::page_used() const
+{
+    size_t len = value_header_size(reallen, trx_id);
+    if (in_vlog()) return len + VLOG_PTR_LEN;
+    return len + std::min(limit.over_value, (size_t)reallen);
+}
+
+void translation_table::save_value(std::string& buf, const key_t& key, value_t *value)
 {
     uint32_t len = value->reallen;
-    encode32(buf, len);
-    encode64(buf, value->trx_id);
+    encode_value_header(buf, value->reallen, value->in_vlog(), value->trx_id);
     if (len <= limit.over_value) {
         buf.append(*value->val);
         return;
     }
+    if (value->in_vlog()) {
+        if (value->vlog_file == 0) {
+            db->vlog.append(key, *value->val, &value->vlog_file, &value->vlog_off);
+            // 之后再需要完整的值时从value-log中读取
+            std::string().swap(*value->val);
+        }
+        encode32(buf, value->vlog_file);
+        encode64(buf, value->vlog_off);
+        return;
+    }
     // 我们只需将存储到叶节点本身的部分数据写入磁盘即可
     if (value->over_page_id > 0) {
         encode_page_id(buf, value->over_page_id);
@@ -254,21 +800,22 @@ void translation_table::save_value(std::string& buf, value_t *value)
     value->over_page_id = n > 0 ? db->page_manager.alloc_page() : over_page.first;
 
     page_id_t page_id = value->over_page_id;
+    page_frame frame(db->page_io);
     for (int i = 0; i < n; i++) {
-        struct iovec iov[2];
+        char *buf = frame.data();
         page_id_t next_page_id;
         if (i == n - 1) {
             next_page_id = r > 0 ? over_page.first : 0;
         } else {
             next_page_id = db->page_manager.alloc_page();
         }
-        iov[0].iov_base = &next_page_id;
-        iov[0].iov_len = sizeof(next_page_id);
-        iov[1].iov_base = value->val->data() + pos;
-        iov[1].iov_len = pages[i];
+        memcpy(buf, &next_page_id, sizeof(next_page_id));
+        memcpy(buf + sizeof(next_page_id), value->val->data() + pos, pages[i]);
+        if (pages[i] < CAP_OF_OVER_PAGE) {
+            memset(buf + sizeof(next_page_id) + pages[i], 0, CAP_OF_OVER_PAGE - pages[i]);
+        }
         pos += pages[i];
-        lseek(db->fd, page_id, SEEK_SET);
-        writev(db->fd, iov, 2);
+        db->page_io.write_page(page_id, buf);
         page_id = next_page_id;
     }
     encode_page_id(buf, value->over_page_id);
@@ -278,45 +825,77 @@ void translation_table::save_value(std::string& buf, value_t *value)
     buf.append(*value->val);
 }
 
+// 节点并不会在加载时解码，见node::unpack()
 node *translation_table::load_node(page_id_t page_id)
 {
-    void *start = mmap(nullptr, db->header.page_size, PROT_READ, MAP_SHARED, db->fd, page_id);
-    if (start == MAP_FAILED) {
-        panic("load_node: load node failed from page_id=%lld: %s", page_id, strerror(errno));
-    }
-    char *buf = reinterpret_cast<char*>(start);
+    page_frame frame(db->page_io);
+    db->page_io.read_page(page_id, frame.data());
+    char *buf = frame.data();
     uint8_t leaf = decode8(&buf);
     node *node = new struct node(leaf);
     uint16_t keynums = decode16(&buf);
-    node->keys.reserve(keynums);
-    for (int i = 0; i < keynums; i++) {
-        uint8_t keylen = decode8(&buf);
-        node->keys.emplace_back(buf, keylen);
-        buf += keylen;
-    }
     if (node->leaf) {
-        node->values.reserve(keynums);
-        for (int i = 0; i < keynums; i++) {
-            node->values.emplace_back(load_value(&buf));
-        }
         node->left = decode_page_id(&buf);
         node->right = decode_page_id(&buf);
-    } else {
-        node->childs.reserve(keynums);
-        for (int i = 0; i < keynums; i++) {
-            node->childs.emplace_back(decode_page_id(&buf));
-        }
     }
+    node->prefix = decode8(&buf);
+    buf += node->prefix;
+    // 只需保留到最后一个记录的末尾
+    size_t len = buf - frame.data() + keynums * limit.slot_field;
+    for (int i = 0; i < keynums; i++) {
+        uint16_t off;
+        memcpy(&off, buf + i * limit.slot_field, sizeof(off));
+        char *ptr = frame.data() + off;
+        uint8_t keylen = decode8(&ptr);
+        ptr += keylen;
+        if (node->leaf) skip_value(&ptr);
+        else ptr += sizeof(page_id_t);
+        len = std::max(len, (size_t)(ptr - frame.data()));
+    }
+    node->page.assign(frame.data(), len);
+    node->packed = true;
+    node->page_used = len;
     node->update(false);
-    munmap(start, db->header.page_size);
     return node;
 }
 
+void node::unpack()
+{
+    int n = size();
+    keys.reserve(n);
+    if (leaf) values.reserve(n);
+    else childs.reserve(n);
+    auto key_prefix = packed_prefix();
+    for (int i = 0; i < n; i++) {
+        char *ptr = const_cast<char*>(record(i));
+        uint8_t keylen = decode8(&ptr);
+        keys.emplace_back();
+        keys.back().reserve(key_prefix.size() + keylen);
+        keys.back().append(key_prefix.data(), key_prefix.size());
+        keys.back().append(ptr, keylen);
+        ptr += keylen;
+        if (leaf) values.emplace_back(translation_table::load_value(&ptr));
+        else childs.emplace_back(decode_page_id(&ptr));
+    }
+    std::string().swap(page);
+    packed = false;
+    // 解码不会改变节点的内容，所以要保留之前的dirty
+    bool was_dirty = dirty;
+    update(false);
+    dirty = was_dirty;
+}
+
 value_t *translation_table::load_value(char **ptr)
 {
     value_t *value = new value_t();
-    value->reallen = decode32(ptr);
-    value->trx_id = decode64(ptr);
+    bool in_vlog;
+    value->reallen = decode_value_header(ptr, &value->trx_id, &in_vlog);
+    if (in_vlog) {
+        value->vlog_file = decode32(ptr);
+        value->vlog_off = decode64(ptr);
+        value->val = new std::string();
+        return value;
+    }
     if (value->reallen <= limit.over_value) {
         value->val = new std::string(*ptr, value->reallen);
         *ptr += value->reallen;
@@ -332,9 +911,52 @@ value_t *translation_table::load_value(char **ptr)
     return value;
 }
 
-// 查找溢出页，取出完整的value
+void translation_table::skip_value(char **ptr)
+{
+    trx_id_t trx_id;
+    bool in_vlog;
+    uint32_t reallen = decode_value_header(ptr, &trx_id, &in_vlog);
+    if (in_vlog) *ptr += VLOG_PTR_LEN;
+    else if (reallen <= limit.over_value) *ptr += reallen;
+    else *ptr += sizeof(page_id_t) + 2 + OVER_VALUE_LEN;
+}
+
+// 取出叶节点x中第i个value的完整值
+// packed的节点直接从page中拷贝，只有存在溢出页时才需要构造value_t
+void translation_table::read_value(node *x, int i, std::string *saved_val)
+{
+    if (!x->packed) {
+        load_real_value(x->values[i], saved_val);
+        return;
+    }
+    char *ptr = const_cast<char*>(x->record(i));
+    uint8_t keylen = decode8(&ptr);
+    ptr += keylen;
+    char *val = ptr;
+    trx_id_t trx_id;
+    bool in_vlog;
+    uint32_t reallen = decode_value_header(&val, &trx_id, &in_vlog);
+    if (in_vlog) {
+        uint32_t file = decode32(&val);
+        uint64_t off = decode64(&val);
+        db->vlog.read(file, off, reallen, saved_val);
+        return;
+    }
+    if (reallen <= limit.over_value) {
+        saved_val->assign(val, reallen);
+        return;
+    }
+    std::unique_ptr<value_t> value(load_value(&ptr));
+    load_real_value(value.get(), saved_val);
+}
+
+// 查找溢出页或value-log，取出完整的value
 void translation_table::load_real_value(value_t *value, std::string *saved_val)
 {
+    if (value->vlog_file > 0) {
+        db->vlog.read(value->vlog_file, value->vlog_off, value->reallen, saved_val);
+        return;
+    }
     page_id_t page_id = value->over_page_id;
     if (page_id == 0) {
         // 对于还未落盘的数据，value->reallen可能大于limit.over_value
@@ -344,12 +966,11 @@ void translation_table::load_real_value(value_t *value, std::string *saved_val)
     uint32_t len = value->reallen - OVER_VALUE_LEN;
     assert(value->val->size() == OVER_VALUE_LEN);
     saved_val->assign(*value->val);
+    saved_val->reserve(value->reallen);
+    page_frame frame(db->page_io);
     while (true) {
-        void *start = mmap(nullptr, db->header.page_size, PROT_READ, MAP_SHARED, db->fd, page_id);
-        if (start == MAP_FAILED) {
-            panic("load_real_value: load page failed from page_id=%lld: %s", page_id, strerror(errno));
-        }
-        char *buf = reinterpret_cast<char*>(start);
+        db->page_io.read_page(page_id, frame.data());
+        char *buf = frame.data();
         page_id = decode_page_id(&buf);
         if (len >= CAP_OF_OVER_PAGE) {
             saved_val->append(buf, CAP_OF_OVER_PAGE);
@@ -362,23 +983,112 @@ void translation_table::load_real_value(value_t *value, std::string *saved_val)
             }
             page_id = 0;
         }
-        munmap(start, db->header.page_size);
         if (page_id == 0) break;
     }
 }
 
+void translation_table::read_range(node *x, int i, size_t off, size_t n, std::string *saved_val)
+{
+    if (!x->packed) {
+        read_range(x->values[i], off, n, saved_val);
+        return;
+    }
+    char *ptr = const_cast<char*>(x->record(i));
+    uint8_t keylen = decode8(&ptr);
+    ptr += keylen;
+    char *val = ptr;
+    trx_id_t trx_id;
+    bool in_vlog;
+    uint32_t reallen = decode_value_header(&val, &trx_id, &in_vlog);
+    if (!in_vlog && reallen <= limit.over_value) {
+        if (off >= reallen) saved_val->clear();
+        else saved_val->assign(val + off, std::min(n, reallen - off));
+        return;
+    }
+    std::unique_ptr<value_t> value(load_value(&ptr));
+    read_range(value.get(), off, n, saved_val);
+}
+
+void translation_table::read_range(value_t *value, size_t off, size_t n, std::string *saved_val)
+{
+    if (off >= value->reallen) {
+        saved_val->clear();
+        return;
+    }
+    n = std::min(n, value->reallen - off);
+    if (value->vlog_file > 0) {
+        db->vlog.read(value->vlog_file, value->vlog_off + off, n, saved_val);
+        return;
+    }
+    // 没有溢出页或者还未落盘的value都完整地保存在val中
+    if (value->over_page_id == 0) {
+        saved_val->assign(*value->val, off, n);
+        return;
+    }
+    saved_val->clear();
+    saved_val->reserve(n);
+    if (off < OVER_VALUE_LEN) {
+        saved_val->append(*value->val, off, std::min(n, OVER_VALUE_LEN - off));
+    }
+    walk_over_pages(value, off, n, [saved_val](char *page, size_t page_off, size_t len) {
+        saved_val->append(page + page_off, len);
+    });
+}
+
+bool translation_table::write_range(value_t *value, size_t off, const std::string& data)
+{
+    if (value->vlog_file > 0) return false;
+    size_t n = data.size();
+    assert(off + n <= value->reallen);
+    // 没有溢出页时val中就是完整的value
+    if (value->over_page_id > 0 && off + n > OVER_VALUE_LEN) return false;
+    value->val->replace(off, n, data);
+    return true;
+}
+
+// 按顺序访问value的溢出页中与[off, off + n)相交的每一段，分块方式见save_value()
+// 相交的页会被整页读出交给visit，其他页只需读出页首的next-over-page-id
+// page-off是这一段在页内的偏移
+void translation_table::walk_over_pages(value_t *value, size_t off, size_t n, const over_page_visitor& visit)
+{
+    size_t end = off + n;
+    size_t pos = OVER_VALUE_LEN;
+    size_t len = value->reallen - OVER_VALUE_LEN;
+    page_id_t page_id = value->over_page_id;
+    page_frame frame(db->page_io);
+    while (pos < end) {
+        size_t seg = std::min(len, CAP_OF_OVER_PAGE);
+        bool last = len <= CAP_OF_OVER_PAGE;
+        bool shared = seg < CAP_OF_OVER_PAGE && seg <= CAP_OF_SHARED_OVER_PAGE;
+        size_t from = std::max(off, pos), to = std::min(end, pos + seg);
+        page_id_t next_page_id = 0;
+        if (from < to) {
+            db->page_io.read_page(page_id, frame.data());
+            memcpy(&next_page_id, frame.data(), sizeof(next_page_id));
+            size_t page_off = shared ? value->page_off : sizeof(page_id_t);
+            visit(frame.data(), page_off + (from - pos), to - from);
+        } else if (!last) {
+            db->page_io.read(page_id, reinterpret_cast<char*>(&next_page_id), sizeof(next_page_id));
+        }
+        if (last) break;
+        pos += seg;
+        len -= seg;
+        page_id = next_page_id;
+    }
+}
+
 void translation_table::free_value(value_t *value)
 {
-    int fd = db->get_db_fd();
     uint32_t len = value->reallen;
+    // value-log中的空间由后台回收
+    if (value->vlog_file > 0) db->vlog.discard(value->vlog_file, len);
     // 必须是已落盘的数据
     if (value->over_page_id > 0 && len > limit.over_value) {
         page_id_t page_id = value->over_page_id;
         len -= OVER_VALUE_LEN;
         while (true) {
             page_id_t next_page_id;
-            lseek(fd, page_id, SEEK_SET);
-            read(fd, &next_page_id, sizeof(page_id_t));
+            db->page_io.read(page_id, reinterpret_cast<char*>(&next_page_id), sizeof(next_page_id));
             if (len >= CAP_OF_OVER_PAGE) {
                 db->page_manager.free_page(page_id);
                 len -= CAP_OF_OVER_PAGE;
@@ -393,26 +1103,84 @@ void translation_table::free_value(value_t *value)
             }
         }
     }
-    db->put_db_fd(fd);
     delete value;
 }
 
+// 找出以page_id为根的子树中的节点所在的页，以及叶节点中的value占用的溢出页
+// 它只在init()时由page_manager调用，所以节点不必放入缓存
+void translation_table::used_pages(page_id_t page_id, std::vector<page_id_t>& pages)
+{
+    std::vector<page_id_t> stack = { page_id };
+    while (!stack.empty()) {
+        page_id = stack.back();
+        stack.pop_back();
+        pages.push_back(page_id);
+        std::unique_ptr<node> x(load_node(page_id));
+        x->unpack();
+        if (!x->leaf) {
+            stack.insert(stack.end(), x->childs.begin(), x->childs.end());
+            continue;
+        }
+        // 与free_value()中的遍历一致
+        for (auto value : x->values) {
+            if (value->over_page_id == 0 || value->reallen <= limit.over_value) continue;
+            page_id_t over_page_id = value->over_page_id;
+            size_t len = value->reallen - OVER_VALUE_LEN;
+            while (true) {
+                pages.push_back(over_page_id);
+                if (len < CAP_OF_OVER_PAGE) break;
+                len -= CAP_OF_OVER_PAGE;
+                page_id_t next_page_id;
+                db->page_io.read(over_page_id, reinterpret_cast<char*>(&next_page_id), sizeof(next_page_id));
+                if (next_page_id == 0) break;
+                over_page_id = next_page_id;
+            }
+        }
+    }
+}
+
+void translation_table::move_node(node *x, page_id_t to)
+{
+    // 根节点并不在转换表中
+    if (x != db->root.get()) {
+        auto& shard = get_shard(x->page_id);
+        wlock_t wlk(shard.latch);
+        shard.pages[x->page_id].x.release();
+        erase(shard, x->page_id);
+    }
+    save_node(to, x);
+    if (x != db->root.get()) cache_put(to, x, false);
+}
+
+void translation_table::write_nodes(std::vector<node*>& nodes)
+{
+    std::vector<page_write> pages(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        pages[i].page_id = nodes[i]->page_id;
+        encode_node(pages[i].buf, nodes[i]);
+    }
+    // 节点引用的value必须先于节点落盘
+    if (db->ops.value_log) db->vlog.sync();
+    db->page_io.write_pages(pages);
+}
+
 void translation_table::free_node(page_id_t page_id, node *node)
 {
-    cache_list.erase(translation_to_node[page_id].pos);
-    translation_to_page.erase(node);
-    translation_to_node.erase(page_id);
+    auto& shard = get_shard(page_id);
+    {
+        wlock_t wlk(shard.latch);
+        erase(shard, page_id);
+    }
     db->page_manager.free_page(page_id);
 }
 
 void translation_table::release_root(node *root)
 {
     page_id_t page_id = to_page_id(root);
-    wlock_t wlk(table_latch);
-    cache_list.erase(translation_to_node[page_id].pos);
-    translation_to_node[page_id].x.release();
-    translation_to_node.erase(page_id);
-    translation_to_page.erase(root);
+    auto& shard = get_shard(page_id);
+    wlock_t wlk(shard.latch);
+    shard.pages[page_id].x.release();
+    erase(shard, page_id);
 }
 
 } // namespace bpdb
@@ -2,13 +2,20 @@
 #define __BPDB_DISK_H
 
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <list>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 
 #include <sys/uio.h>
 
 #include "page.h"
+#include "io.h"
 #include "common.h"
 
 namespace bpdb {
@@ -18,49 +25,121 @@ class DB;
 // 转换表中并不保存根节点
 class translation_table {
 public:
-    translation_table(DB *db) : db(db), lru_cap(1024) {  }
+    translation_table(DB *db);
+    ~translation_table();
     translation_table(const translation_table&) = delete;
     translation_table& operator=(const translation_table&) = delete;
 
     void init();
-    void set_cache_cap(int cap) { lru_cap = std::max(128, cap); }
+    // 把上一次check-point之后被覆盖的页(提前写回的，或者未完成的check-point写入的)恢复为check-point时的内容
+    // 它必须在重放wal之前调用
+    void recover();
+    void set_cache_cap(int cap) { cache_cap = std::max(128, cap); }
+    void set_cache_bytes(size_t bytes) { cache_bytes = bytes; }
     node *load_node(page_id_t page_id);
+    void used_pages(page_id_t page_id, std::vector<page_id_t>& pages);
     void load_real_value(value_t *value, std::string *saved_val);
+    void read_value(node *x, int i, std::string *saved_val);
+    // 只读取value中[off, off + n)的部分，溢出页中只有这部分所在的页才会被整页读出
+    void read_range(value_t *value, size_t off, size_t n, std::string *saved_val);
+    void read_range(node *x, int i, size_t off, size_t n, std::string *saved_val);
+    // 原地覆盖value中[off, off + data.size())的部分，它不能超出value的末尾
+    // 只有保存在叶节点中的部分才能原地修改，溢出页和value-log中的数据都不能改动，这时返回false
+    bool write_range(value_t *value, size_t off, const std::string& data);
     void free_value(value_t *value);
     void release_root(node *root);
-    node *to_node(page_id_t page_id);
+    // 返回的节点已被pin住，使用完后需调用unpin()
+    // scan表示这是一次顺序扫描中的访问，它不会设置访问位，
+    // 新加载的页也会被放在hand处优先淘汰，以免冲掉缓存中的热点页
+    node *to_node(page_id_t page_id, bool scan = false);
     page_id_t to_page_id(node *node);
-    // 向转换表中加入一个新的表项
-    void put(page_id_t page_id, node *node) { lru_put(page_id, node); }
+    // 向转换表中加入一个新的表项，调用者需保证在此之前node已被pin住
+    void put(page_id_t page_id, node *node) { cache_put(page_id, node, false); }
+    // 把已被pin住的x挪到to处，它会被立即写入新的页，指向它的指针由调用者修改，见DB::compact()
+    void move_node(node *x, page_id_t to);
+    // 直接写入不在转换表中的节点，见bulk_loader
+    void write_nodes(std::vector<node*>& nodes);
+    // 原地修改page_id之前把它在check-point时的内容记入journal，调用者需持有journal_mtx，见page_manager
+    void journal(page_id_t page_id);
     void flush();
+    // page-cleaner会写回脏页甚至触发check-point，所以要等DB::init()完成之后才能启动
+    void start_page_cleaner();
+    void quit_page_cleaner();
 private:
     struct cache_node {
         std::unique_ptr<node> x;
         std::list<page_id_t>::iterator pos;
-        cache_node() : x(nullptr), pos() {  }
-        cache_node(node *x, std::list<page_id_t>::iterator pos) : x(std::unique_ptr<node>(x)), pos(pos) { }
+        // CLOCK中的访问位，命中时只需设置它，而不必移动链表
+        std::atomic_bool ref;
+        // 计入shard.bytes的x->mem_used，节点大小变化后会在访问时修正
+        std::atomic_size_t charge;
+        cache_node() : x(nullptr), pos(), ref(false), charge(0) {  }
+    };
+    // 缓存按page_id划分为多个shard，每个shard有自己的latch和CLOCK
+    // 这样命中时只需持有所在shard的读锁
+    struct cache_shard {
+        std::unordered_map<page_id_t, cache_node> pages;
+        std::list<page_id_t> clock;
+        std::list<page_id_t>::iterator hand;
+        std::shared_mutex latch;
+        // 同一shard内的缺页是串行加载的
+        std::mutex load_latch;
+        // 该shard中所有节点的charge之和
+        std::atomic_size_t bytes;
+        cache_shard() : hand(clock.end()), bytes(0) {  }
     };
 
-    node *lru_get(page_id_t page_id);
-    void lru_put(page_id_t page_id, node *node);
+    cache_shard& get_shard(page_id_t page_id);
+    node *cache_get(page_id_t page_id, bool scan = false);
+    node *cache_put(page_id_t page_id, node *node, bool pin, bool scan = false);
+    void recharge(cache_shard& shard, cache_node& e);
+    bool need_evict(cache_shard& shard);
+    bool evict(cache_shard& shard);
+    void dirty_victims(cache_shard& shard, std::vector<std::pair<uint64_t, node*>>& victims);
+    bool write_back(std::vector<std::pair<uint64_t, node*>>& nodes);
+    bool has_pending_values(node *node);
+    void journal(const std::vector<page_write>& pages);
+    void reset_journal();
+    void erase(cache_shard& shard, page_id_t page_id);
+    void page_clean_handler();
+    void clean_pages();
 
     void fill_header(header_t *header, struct iovec *iov);
     void load_header();
     void save_header(header_t *header);
     void save_node(page_id_t page_id, node *node);
-    void save_value(std::string& buf, value_t *value);
-    value_t *load_value(char **ptr);
+    void encode_node(std::string& buf, node *node);
+    void save_value(std::string& buf, const key_t& key, value_t *value);
+    static value_t *load_value(char **ptr);
+    static void skip_value(char **ptr);
+    // (page, page-off, n)
+    typedef std::function<void(char*, size_t, size_t)> over_page_visitor;
+    void walk_over_pages(value_t *value, size_t off, size_t n, const over_page_visitor& visit);
     void free_node(page_id_t page_id, node *node);
 
     void clear();
 
     DB *db;
-    // 双向转换表 && LRU cache
-    std::unordered_map<page_id_t, cache_node> translation_to_node;
-    std::unordered_map<node*, page_id_t> translation_to_page;
-    std::list<page_id_t> cache_list;
-    std::shared_mutex table_latch;
-    int lru_cap;
+    std::vector<std::unique_ptr<cache_shard>> shards;
+    int cache_cap;
+    size_t cache_bytes;
+    // 后台page-cleaner线程，它会持续地写回最早变脏的页，让它们可以被淘汰
+    std::mutex page_cleaner_mtx;
+    std::condition_variable page_cleaner_cv;
+    std::atomic_bool quit_cleaner;
+    std::thread page_cleaner;
+    // 提前写回的页在覆盖之前，它在check-point时的内容会先追加到journal中并落盘，
+    // 崩溃后用它们恢复出check-point时的数据文件，然后才能重放wal
+    // [check-point-seq][<page-id, page>...]
+    int journal_fd = -1;
+    off_t journal_size = 0;
+    // 保护journal，写回期间一直持有它，flush()则在整个check-point期间持有它
+    std::mutex journal_mtx;
+    // 这次check-point之后已经记入journal的页，每个页只需记录一次
+    std::unordered_set<page_id_t> journaled;
+    // 上一次check-point时的high-water，之后的页不在check-point的镜像中，不必记录
+    page_id_t image_end = 0;
+    friend struct node;
 };
 }
 
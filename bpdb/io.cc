@@ -0,0 +1,217 @@
+#include <cstdlib>
+#include <algorithm>
+
+#include "db.h"
+
+namespace bpdb {
+
+// 页帧按4K对齐
+static const size_t frame_align = 4096;
+// 最多缓存的空闲页帧数，多出来的会直接释放掉
+static const size_t max_free_frames = 64;
+// 一次向量写最多的iovec数(IOV_MAX)
+static const size_t max_iov = 1024;
+
+void page_io::init(int fd, size_t page_size, bool direct)
+{
+    clear();
+    this->fd = fd;
+    this->page_size = page_size;
+    this->direct = direct;
+}
+
+void page_io::clear()
+{
+    lock_t lk(latch);
+    for (auto frame : free_frames) {
+        ::free(frame);
+    }
+    free_frames.clear();
+}
+
+char *page_io::alloc_frame()
+{
+    {
+        lock_t lk(latch);
+        if (!free_frames.empty()) {
+            char *frame = free_frames.back();
+            free_frames.pop_back();
+            return frame;
+        }
+    }
+    void *frame;
+    if (posix_memalign(&frame, frame_align, page_size) != 0) {
+        panic("alloc_frame: posix_memalign(%zu) failed", page_size);
+    }
+    return reinterpret_cast<char*>(frame);
+}
+
+void page_io::free_frame(char *frame)
+{
+    {
+        lock_t lk(latch);
+        if (free_frames.size() < max_free_frames) {
+            free_frames.push_back(frame);
+            return;
+        }
+    }
+    ::free(frame);
+}
+
+void page_io::read_page(page_id_t page_id, char *frame)
+{
+    ssize_t r;
+    // 对于普通文件，只有读到文件末尾时才会返回比请求的少的字节数
+    while ((r = pread(fd, frame, page_size, page_id)) < 0) {
+        if (errno != EINTR) {
+            panic("read_page: pread(page_id=%lld): %s", page_id, strerror(errno));
+        }
+    }
+    // 页尾可能还没有写过，这部分就是文件空洞
+    if ((size_t)r < page_size) memset(frame + r, 0, page_size - r);
+}
+
+void page_io::write_page(page_id_t page_id, const char *frame)
+{
+    pwrite_all(page_id, frame, page_size);
+}
+
+void page_io::read(page_id_t page_id, char *buf, size_t n)
+{
+    if (direct) {
+        page_frame frame(*this);
+        read_page(page_id, frame.data());
+        memcpy(buf, frame.data(), n);
+        return;
+    }
+    ssize_t r;
+    while ((r = pread(fd, buf, n, page_id)) < 0) {
+        if (errno != EINTR) {
+            panic("page_io::read: pread(page_id=%lld): %s", page_id, strerror(errno));
+        }
+    }
+    if ((size_t)r < n) memset(buf + r, 0, n - r);
+}
+
+void page_io::write(page_id_t page_id, const char *buf, size_t n)
+{
+    if (direct) {
+        page_frame frame(*this);
+        memcpy(frame.data(), buf, n);
+        memset(frame.data() + n, 0, page_size - n);
+        write_page(page_id, frame.data());
+        return;
+    }
+    pwrite_all(page_id, buf, n);
+}
+
+void page_io::pwrite_all(off_t off, const char *buf, size_t n)
+{
+    size_t written = 0;
+    while (written < n) {
+        ssize_t r = pwrite(fd, buf + written, n - written, off + written);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            panic("page_io::write: pwrite(off=%lld): %s", off + written, strerror(errno));
+        }
+        written += r;
+    }
+}
+
+void page_io::truncate(off_t size)
+{
+    if (ftruncate(fd, size) < 0) {
+        panic("page_io::truncate: ftruncate(%lld): %s", size, strerror(errno));
+    }
+}
+
+void page_io::punch_hole(off_t off, size_t len)
+{
+#if defined (FALLOC_FL_PUNCH_HOLE)
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+#elif defined (F_PUNCHHOLE)
+    struct fpunchhole args = { 0, 0, off, static_cast<off_t>(len) };
+    fcntl(fd, F_PUNCHHOLE, &args);
+#endif
+}
+
+void page_io::write_pages(std::vector<page_write>& pages)
+{
+    if (pages.empty()) return;
+    std::sort(pages.begin(), pages.end(), [](const page_write& l, const page_write& r) {
+        return l.page_id < r.page_id;
+    });
+    // direct时需要先将它们拷贝到对齐的页帧中
+    std::vector<char*> frames;
+    if (direct) {
+        for (auto& page : pages) {
+            char *frame = alloc_frame();
+            memcpy(frame, page.buf.data(), page.buf.size());
+            memset(frame + page.buf.size(), 0, page_size - page.buf.size());
+            frames.push_back(frame);
+        }
+    } else {
+        // 后面紧跟着另一页的页需要补齐到整页，这样它们才能在一次写中相连
+        for (size_t i = 0; i + 1 < pages.size(); i++) {
+            if (pages[i].page_id + (off_t)page_size == pages[i + 1].page_id)
+                pages[i].buf.resize(page_size, '\0');
+        }
+    }
+    std::vector<write_run> runs;
+    for (size_t i = 0; i < pages.size(); i++) {
+        auto& page = pages[i];
+        if (i == 0 || pages[i - 1].page_id + (off_t)page_size != page.page_id ||
+            runs.back().iov.size() >= max_iov) {
+            runs.emplace_back();
+            runs.back().off = page.page_id;
+            runs.back().len = 0;
+        }
+        auto& run = runs.back();
+        struct iovec iov;
+        if (direct) {
+            iov.iov_base = frames[i];
+            iov.iov_len = page_size;
+        } else {
+            iov.iov_base = const_cast<char*>(page.buf.data());
+            iov.iov_len = page.buf.size();
+        }
+        run.iov.push_back(iov);
+        run.len += iov.iov_len;
+    }
+    for (auto& run : runs) {
+        writev(run);
+    }
+    for (auto frame : frames) {
+        free_frame(frame);
+    }
+}
+
+// 跳过run中已写入的前n个字节
+void page_io::advance(write_run& run, size_t n)
+{
+    run.off += n;
+    run.len -= n;
+    size_t i = 0;
+    while (i < run.iov.size() && n >= run.iov[i].iov_len) {
+        n -= run.iov[i++].iov_len;
+    }
+    run.iov.erase(run.iov.begin(), run.iov.begin() + i);
+    if (n > 0) {
+        run.iov[0].iov_base = reinterpret_cast<char*>(run.iov[0].iov_base) + n;
+        run.iov[0].iov_len -= n;
+    }
+}
+
+void page_io::writev(write_run& run)
+{
+    while (run.len > 0) {
+        ssize_t r = pwritev(fd, run.iov.data(), run.iov.size(), run.off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            panic("page_io::writev: pwritev(off=%lld): %s", run.off, strerror(errno));
+        }
+        advance(run, r);
+    }
+}
+
+} // namespace bpdb
@@ -0,0 +1,82 @@
+#ifndef __BPDB_IO_H
+#define __BPDB_IO_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <sys/uio.h>
+
+#include "common.h"
+
+namespace bpdb {
+
+// 一个待写入的页，buf的长度不超过页大小
+struct page_write {
+    page_id_t page_id;
+    std::string buf;
+};
+
+// 以页为单位读写数据文件
+// 页会被读到预先分配好的对齐的页帧中，页帧用完后放回空闲链表以便复用，
+// 这样读一页只需一次pread()
+//
+// 所有线程共用同一个fd，所以读写都必须是带偏移的
+// 如果数据文件是以O_DIRECT打开的(direct)，那么每次读写都必须是对齐的整页
+class page_io {
+public:
+    page_io() : fd(-1), page_size(0), direct(false) {  }
+    ~page_io() { clear(); }
+    page_io(const page_io&) = delete;
+    page_io& operator=(const page_io&) = delete;
+    void init(int fd, size_t page_size, bool direct);
+    char *alloc_frame();
+    void free_frame(char *frame);
+    // 读出page_id处的一整页，超出文件末尾的部分会被填0
+    void read_page(page_id_t page_id, char *frame);
+    void write_page(page_id_t page_id, const char *frame);
+    // 读出页首的n个字节
+    void read(page_id_t page_id, char *buf, size_t n);
+    // 从页首写入n个字节，direct时页的剩余部分会被填0
+    void write(page_id_t page_id, const char *buf, size_t n);
+    // 批量写入多个页，相邻的页会被合并为一次向量写
+    void write_pages(std::vector<page_write>& pages);
+    // 将文件截断到size，size之后的页都是空闲的
+    void truncate(off_t size);
+    // 释放[off, off + len)占用的磁盘空间，文件大小不变，之后读到的都是0
+    // 文件系统不支持时什么也不做
+    void punch_hole(off_t off, size_t len);
+private:
+    // 一段连续的页
+    struct write_run {
+        off_t off;
+        size_t len;
+        std::vector<struct iovec> iov;
+    };
+    void clear();
+    void pwrite_all(off_t off, const char *buf, size_t n);
+    void advance(write_run& run, size_t n);
+    void writev(write_run& run);
+
+    int fd;
+    size_t page_size;
+    bool direct;
+    std::vector<char*> free_frames;
+    std::mutex latch;
+};
+
+// 在作用域内持有一个页帧
+class page_frame {
+public:
+    page_frame(page_io& io) : io(io), frame(io.alloc_frame()) {  }
+    ~page_frame() { io.free_frame(frame); }
+    page_frame(const page_frame&) = delete;
+    page_frame& operator=(const page_frame&) = delete;
+    char *data() { return frame; }
+private:
+    page_io& io;
+    char *frame;
+};
+}
+
+#endif // __BPDB_IO_H
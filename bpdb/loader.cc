@@ -0,0 +1,175 @@
+#include "loader.h"
+#include "db.h"
+
+namespace bpdb {
+
+// 每次为叶节点分配的连续页数
+static const size_t leaf_pages_batch = 64;
+// 攒够这么多节点才写入一次
+static const size_t max_pending_nodes = 256;
+
+bulk_loader::bulk_loader(DB *db, double fill_factor, bool leaves_only)
+    : db(db), leaves_only(leaves_only)
+{
+    fill_bytes = db->header.page_size * fill_factor;
+    levels.push_back(nullptr);
+}
+
+bulk_loader::~bulk_loader()
+{
+    for (auto x : levels) delete x;
+    for (auto x : pending) delete x;
+}
+
+status bulk_loader::add(const std::string& key, const std::string& value)
+{
+    auto s = db->check_limit(key, value);
+    if (!s.is_ok()) return s;
+    node *x = levels[0];
+    if (x && !db->less(x->keys.back(), key)) {
+        return status::error("The keys must be in strictly ascending order");
+    }
+    value_t *v = db->build_new_value(value, nullptr);
+    if (x && db->leaf_used_with(x, key, v) > fill_bytes) {
+        // 叶节点的上界是能区分它和下一个叶节点的最短的key
+        key_t sep = db->shortest_separator(x->keys.back(), key);
+        page_id_t page_id = x->page_id;
+        x->right = alloc_leaf_page();
+        levels[0] = new node(true);
+        levels[0]->page_id = last_leaf_id = x->right;
+        levels[0]->left = page_id;
+        write(x);
+        add_child(1, sep, page_id);
+        x = levels[0];
+    }
+    if (!x) {
+        x = levels[0] = new node(true);
+        x->page_id = leaf_id = last_leaf_id = alloc_leaf_page();
+    }
+    // 与DB::leaf_used_with()一样增量地维护公共前缀，而不必每次都调用update()
+    size_t page_used = db->leaf_used_with(x, key, v);
+    x->prefix = x->keys.empty() ? key.size() : std::min((size_t)x->prefix, common_prefix(x->keys[0], key));
+    x->page_used = page_used;
+    x->keys.push_back(key);
+    x->values.push_back(v);
+    keys++;
+    return status::ok();
+}
+
+// 把子节点<sep, page_id>加入第level层正在填充的索引节点，sep是这个子节点的上界
+// 放不下时就先写出这个索引节点，它的上界就是它最后一个子节点的上界
+void bulk_loader::add_child(size_t level, const key_t& sep, page_id_t page_id)
+{
+    if (leaves_only) {
+        leaves.emplace_back(sep, page_id);
+        return;
+    }
+    if (levels.size() <= level) levels.push_back(nullptr);
+    size_t used = limit.slot_field + limit.key_len_field + sep.size() + sizeof(page_id_t);
+    node *x = levels[level];
+    if (x && x->page_used + used > fill_bytes) {
+        key_t upper = x->keys.back();
+        page_id_t x_page_id = db->page_manager.alloc_page();
+        x->page_id = x_page_id;
+        levels[level] = nullptr;
+        write(x);
+        add_child(level + 1, upper, x_page_id);
+    }
+    if (!levels[level]) levels[level] = new node(false);
+    x = levels[level];
+    x->keys.push_back(sep);
+    x->childs.push_back(page_id);
+    x->page_used += used;
+}
+
+void bulk_loader::append(bulk_loader& loader)
+{
+    if (loader.keys == 0) return;
+    if (keys == 0) leaf_id = loader.leaf_id;
+    else link_leaves(last_leaf_id, loader.leaf_id);
+    for (auto& [sep, page_id] : loader.leaves) {
+        add_child(1, sep, page_id);
+    }
+    last_leaf_id = loader.last_leaf_id;
+    keys += loader.keys;
+}
+
+// 两边的叶节点都已经写入数据文件了，所以直接修改页中的right和left
+void bulk_loader::link_leaves(page_id_t left, page_id_t right)
+{
+    size_t off = limit.type_field + limit.key_nums_field;
+    page_frame frame(db->page_io);
+    db->page_io.read_page(left, frame.data());
+    memcpy(frame.data() + off + sizeof(page_id_t), &right, sizeof(right));
+    db->page_io.write_page(left, frame.data());
+    db->page_io.read_page(right, frame.data());
+    memcpy(frame.data() + off, &left, sizeof(left));
+    db->page_io.write_page(right, frame.data());
+}
+
+node *bulk_loader::finish()
+{
+    // 从最下面一层正在填充的节点开始，逐层写出并加入上一层
+    // append()之后叶节点那一层是空的
+    size_t level = 0;
+    while (level < levels.size() && !levels[level]) level++;
+    node *x = nullptr;
+    for ( ; level < levels.size(); level++) {
+        x = levels[level];
+        levels[level] = nullptr;
+        // 最上面一层只剩下x，它就是根节点
+        if (level + 1 == levels.size() && !leaves_only) break;
+        key_t upper = x->keys.back();
+        if (!x->leaf) x->page_id = db->page_manager.alloc_page();
+        page_id_t x_page_id = x->page_id;
+        // write()之后x可能已经被释放了
+        write(x);
+        x = nullptr;
+        add_child(level + 1, upper, x_page_id);
+    }
+    flush();
+    // 归还没有用完的叶节点页
+    for ( ; free_pages > 0; free_pages--) {
+        db->page_manager.free_page(next_page);
+        next_page += db->header.page_size;
+    }
+    if (!x) return nullptr;
+    if (!x->leaf && x->size() == 1) {
+        // append()的只有一个叶节点，它自己就是根节点
+        page_id_t page_id = x->childs[0];
+        delete x;
+        x = db->translation_table.load_node(page_id);
+        x->page_id = page_id;
+    } else if (!x->leaf) {
+        x->page_id = db->page_manager.alloc_page();
+    }
+    x->update();
+    return x;
+}
+
+page_id_t bulk_loader::alloc_leaf_page()
+{
+    if (free_pages == 0) {
+        next_page = db->page_manager.alloc_run(leaf_pages_batch, true);
+        free_pages = leaf_pages_batch;
+    }
+    page_id_t page_id = next_page;
+    next_page += db->header.page_size;
+    free_pages--;
+    return page_id;
+}
+
+void bulk_loader::write(node *x)
+{
+    pending.push_back(x);
+    if (pending.size() >= max_pending_nodes) flush();
+}
+
+void bulk_loader::flush()
+{
+    db->translation_table.write_nodes(pending);
+    for (auto x : pending) delete x;
+    pending.clear();
+}
+
+} // namespace bpdb
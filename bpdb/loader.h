@@ -0,0 +1,65 @@
+#ifndef __BPDB_LOADER_H
+#define __BPDB_LOADER_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+namespace bpdb {
+
+class DB;
+
+// 自底向上地构建一棵B+树，见DB::bulk_load()
+//
+// key按顺序加入，叶节点从左到右依次填到fill_factor，写满一个就换下一个，
+// 叶节点的页是成段分配的，所以它们在文件中基本是连续的
+// 每写完一个节点，就把它的上界和页号加入上一层正在填充的索引节点中，
+// 所以每一层都只有最右边的那个节点在内存中
+//
+// 节点不经过转换表，攒够一批后直接顺序写入数据文件，也不写wal
+//
+// 并行导入时，每个线程用一个leaves_only的bulk_loader只导入一段叶节点，
+// 然后由一个普通的bulk_loader依次append()它们，链接叶节点链表，并在其上构建索引节点
+class bulk_loader {
+public:
+    bulk_loader(DB *db, double fill_factor, bool leaves_only = false);
+    ~bulk_loader();
+    bulk_loader(const bulk_loader&) = delete;
+    bulk_loader& operator=(const bulk_loader&) = delete;
+    // key必须严格递增
+    status add(const std::string& key, const std::string& value);
+    // 把leaves_only的loader导入的叶节点接在后面，它的key必须都大于之前的key
+    void append(bulk_loader& loader);
+    // 写出剩下的节点并返回根节点，根节点常驻内存，所以它不会被写入
+    // 没有加入任何key或者leaves_only时返回nullptr
+    node *finish();
+    page_id_t first_leaf() const { return leaf_id; }
+    size_t key_nums() const { return keys; }
+private:
+    void add_child(size_t level, const key_t& sep, page_id_t page_id);
+    void link_leaves(page_id_t left, page_id_t right);
+    page_id_t alloc_leaf_page();
+    void write(node *x);
+    void flush();
+
+    DB *db;
+    // 节点最多填充到的字节数
+    size_t fill_bytes;
+    // 每一层正在填充的节点，levels[0]是叶节点
+    std::vector<node*> levels;
+    // 等待写入的节点
+    std::vector<node*> pending;
+    // 预先分配的连续的叶节点页[next_page, next_page + free_pages * page_size)
+    page_id_t next_page = 0;
+    size_t free_pages = 0;
+    page_id_t leaf_id = 0;
+    page_id_t last_leaf_id = 0;
+    size_t keys = 0;
+    // 只导入叶节点，写完的叶节点<上界, 页号>都保存在leaves中
+    bool leaves_only;
+    std::vector<std::pair<key_t, page_id_t>> leaves;
+};
+}
+
+#endif // __BPDB_LOADER_H
@@ -33,13 +33,42 @@ void logger::append_wal(char type, const std::string& key, value_t *value, std::
     if (recovery) return;
     {
         lock_t lk(log_mtx);
+        size_t old_buf_size = write_buf.size();
         format_wal(type, key, value, realval);
         cur_buf_size = write_buf.size();
+        lsn += cur_buf_size - old_buf_size;
     }
+    try_flush_wal(cur_buf_size);
+}
+
+// [Write][trx-id(0)][key-len][key][off][data-len][data]
+// 重放时覆盖同样的字节，所以重复重放也没有问题
+void logger::append_range(const std::string& key, uint32_t off, const std::string& data)
+{
+    int cur_buf_size;
+    if (recovery) return;
+    {
+        lock_t lk(log_mtx);
+        size_t old_buf_size = write_buf.size();
+        write_buf.append(1, Write);
+        encode64(write_buf, 0);
+        encode8(write_buf, key.size());
+        write_buf.append(key);
+        encode32(write_buf, off);
+        encode32(write_buf, data.size());
+        write_buf.append(data);
+        cur_buf_size = write_buf.size();
+        lsn += cur_buf_size - old_buf_size;
+    }
+    try_flush_wal(cur_buf_size);
+}
+
+void logger::try_flush_wal(size_t cur_buf_size)
+{
     if (db->ops.wal_sync == 0) {
         flush_wal();
     } else if (db->ops.wal_sync == 1) {
-        if (cur_buf_size >= db->ops.wal_sync_buffer_size) {
+        if (cur_buf_size >= (size_t)db->ops.wal_sync_buffer_size) {
             flush_wal();
         }
     }
@@ -64,24 +93,44 @@ void logger::format_wal(char type, const std::string& key, value_t *value, std::
 
 void logger::flush_wal(bool wait)
 {
-    sync_wal = true;
+    uint64_t target_lsn;
+    {
+        lock_t lk(log_mtx);
+        target_lsn = lsn;
+        sync_wal = true;
+    }
     log_cv.notify_one();
-    if (wait) while (sync_wal) ;
+    if (wait) {
+        std::unique_lock<std::mutex> ulock(log_mtx);
+        sync_cv.wait(ulock, [this, target_lsn]{ return sync_lsn >= target_lsn; });
+    }
 }
 
 void logger::sync_log_handler()
 {
-    while (!quit_sync_logger) {
+    while (true) {
+        uint64_t flush_lsn;
         {
             std::unique_lock<std::mutex> ulock(log_mtx);
-            log_cv.wait_for(ulock, std::chrono::seconds(db->ops.wal_wake_interval));
-            if (write_buf.empty()) { sync_wal = false; continue; }
+            log_cv.wait_for(ulock, std::chrono::seconds(db->ops.wal_wake_interval),
+                            [this]{ return sync_wal || quit_sync_logger; });
+            sync_wal = false;
+            if (write_buf.empty()) {
+                // 退出前要保证已追加的wal都已落盘
+                if (quit_sync_logger) break;
+                continue;
+            }
             write_buf.swap(flush_buf);
+            flush_lsn = lsn;
         }
         write(log_fd, flush_buf.data(), flush_buf.size());
         sync_fd(log_fd);
         flush_buf.clear();
-        sync_wal = false;
+        {
+            lock_t lk(log_mtx);
+            sync_lsn = flush_lsn;
+        }
+        sync_cv.notify_all();
     }
 }
 
@@ -96,14 +145,20 @@ void logger::replay()
     char *ptr = reinterpret_cast<char*>(start);
     char *end = ptr + st.st_size;
     std::string key, value;
+    // 崩溃时最后一条wal可能只写入了一部分，它的修改还没有返回给调用者，丢弃即可
+    auto torn = [&ptr, end](size_t n) { return (size_t)(end - ptr) < n; };
     while (ptr < end) {
+        if (torn(1 + sizeof(trx_id_t) + 1)) break;
         char type = *ptr++;
         trx_id_t xid = decode64(&ptr);
         uint8_t keylen = decode8(&ptr);
+        if (torn(keylen)) break;
         key.assign(ptr, keylen);
         ptr += keylen;
         if (type == Insert || type == Update) {
+            if (torn(4)) break;
             uint32_t valuelen = decode32(&ptr);
+            if (torn(valuelen)) break;
             value.assign(ptr, valuelen);
             ptr += valuelen;
             if (!xid_set.count(xid)) continue;
@@ -112,6 +167,15 @@ void logger::replay()
         } else if (type == Delete) {
             if (!xid_set.count(xid)) continue;
             db->erase(key);
+        } else if (type == Write) {
+            if (torn(8)) break;
+            uint32_t off = decode32(&ptr);
+            uint32_t datalen = decode32(&ptr);
+            if (torn(datalen)) break;
+            value.assign(ptr, datalen);
+            ptr += datalen;
+            if (!xid_set.count(xid)) continue;
+            db->write_range(key, off, value);
         }
     }
     munmap(start, st.st_size);
@@ -123,6 +187,7 @@ void logger::check_point()
     db->Checkpoint = true;
     // 我们必须保证wal先于数据落盘
     flush_wal(true);
+    check_point_requested = true;
     check_point_cv.notify_one();
 }
 
@@ -141,19 +206,31 @@ void logger::clean_handler()
 {
     while (!quit_cleaner) {
         std::unique_lock<std::mutex> ulock(check_point_mtx);
-        check_point_cv.wait_for(ulock, std::chrono::seconds(db->ops.check_point_interval));
+        check_point_cv.wait_for(ulock, std::chrono::seconds(db->ops.check_point_interval),
+                                [this]{ return check_point_requested || quit_cleaner; });
+        check_point_requested = false;
         if (!quit_cleaner && db->trmgr.have_active_transaction()) {
             // 阻塞生成新事务，并等待所有活跃事务提交
             db->trmgr.set_blocking(true);
             continue;
         }
-        if (!db->Checkpoint) check_point();
+        if (!db->Checkpoint) {
+            check_point();
+            // 这是我们自己发起的，不必再唤醒一次
+            check_point_requested = false;
+        }
         if (db->Rebuild) {
             db->Checkpoint = false;
             continue;
         }
         db->wait_sync_point(false);
         db->translation_table.flush();
+        if (db->ops.compaction && !quit_cleaner) db->compact(db->ops.compaction_pages);
+        if (db->Recluster) {
+            if (db->recluster(SIZE_MAX)) db->Recluster = false;
+        } else if (db->ops.recluster && !quit_cleaner) {
+            db->recluster(db->ops.recluster_pages);
+        }
         unlink(log_file.c_str());
         close(log_fd);
         if (!quit_cleaner) {
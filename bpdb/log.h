@@ -18,14 +18,15 @@ class DB;
 
 class logger {
 public:
-    logger(DB *db) : db(db),
-        quit_sync_logger(false), sync_logger([this]{ this->sync_log_handler(); }), sync_wal(false),
-        quit_cleaner(false), cleaner([this]{ this->clean_handler(); }) {  }
+    logger(DB *db) : db(db), quit_sync_logger(false), sync_wal(false), check_point_requested(false), quit_cleaner(false),
+        sync_logger([this]{ this->sync_log_handler(); }), cleaner([this]{ this->clean_handler(); }) {  }
     logger(const logger&) = delete;
     logger& operator=(const logger&) = delete;
     void init();
     void append_wal(char type, const std::string& key, value_t *value = nullptr,
                     std::string *realval = nullptr);
+    // 覆盖value中从off开始的部分，见DB::write_range()
+    void append_range(const std::string& key, uint32_t off, const std::string& data);
     void flush_wal(bool wait = false);
     void check_point();
     void quit_check_point();
@@ -36,6 +37,7 @@ private:
     void replay();
 
     void format_wal(char type, const std::string& key, value_t *value, std::string *realval);
+    void try_flush_wal(size_t cur_buf_size);
 
     DB *db;
     int log_fd;
@@ -44,15 +46,20 @@ private:
     std::mutex log_mtx;
     std::condition_variable log_cv;
     std::atomic_bool quit_sync_logger;
-    std::thread sync_logger;
     std::atomic_bool sync_wal;
     std::string write_buf, flush_buf;
+    // 已追加的和已落盘的wal字节数，flush_wal(true)据此等待自己之前的wal落盘
+    uint64_t lsn = 0;
+    uint64_t sync_lsn = 0;
+    std::condition_variable sync_cv;
     std::mutex check_point_mtx;
     std::condition_variable check_point_cv;
+    // 后台线程可能还没开始等待check_point_cv，这样通知就丢了，所以还要记下这次请求
+    std::atomic_bool check_point_requested;
     std::atomic_bool quit_cleaner;
+    // 后台线程要放在最后构造，它们会用到上面的所有成员
+    std::thread sync_logger;
     std::thread cleaner;
-    // LSN(Log Sequence Number)
-    // off_t lsn = 0; // We don't need for now
 };
 }
 
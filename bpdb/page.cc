@@ -1,74 +1,398 @@
+#include <sys/stat.h>
+#include <math.h>
+
 #include "page.h"
 #include "db.h"
 #include "codec.h"
-
-#include <sys/mman.h>
-#include <sys/stat.h>
+#include "util.h"
 
 namespace bpdb {
 
+// 最大的空闲块也小于64K
+static const int max_size_classes = 16;
+// 分配时在round_n所在的那一级中最多查看的块数
+static const int max_probes = 8;
+
+// 每个线程一次从free_extents中取出的页数
+static const size_t alloc_batch = 16;
+
+static std::atomic<uint64_t> next_cache_id = 1;
+
+page_manager::~page_manager()
+{
+    clear();
+}
+
 void page_manager::init()
 {
     clear();
-    // build over_page_map and avail_map
+    // build over_page_map and size_classes
     page_id_t page_id = db->header.over_page_list_head;
-    over_page_info over_page;
-    for (int i = 0; i < db->header.over_pages; i++) {
-        struct iovec iov[3];
-        lseek(db->fd, page_id, SEEK_SET);
-        iov[0].iov_base = &over_page.next_page_id;
-        iov[0].iov_len = sizeof(over_page.next_page_id);
-        iov[1].iov_base = &over_page.avail;
-        iov[1].iov_len = sizeof(over_page.avail);
-        iov[2].iov_base = &over_page.free_block_head;
-        iov[2].iov_len = sizeof(over_page.free_block_head);
-        readv(db->fd, iov, 3);
-        over_page_map.emplace(page_id, over_page);
-        avail_map[over_page.avail].push_back(page_id);
-        over_page.prev_page_id = page_id;
+    page_id_t prev_page_id = 0;
+    page_frame frame(db->page_io);
+    for (size_t i = 0; i < db->header.over_pages; i++) {
+        db->page_io.read_page(page_id, frame.data());
+        char *ptr = frame.data();
+        auto& over_page = over_page_map[page_id];
+        over_page.prev_page_id = prev_page_id;
+        over_page.next_page_id = decode_page_id(&ptr);
+        over_page.avail = decode16(&ptr);
+        uint16_t off = decode16(&ptr);
+        while (off > 0) {
+            ptr = frame.data() + off;
+            uint16_t next_off = decode16(&ptr);
+            uint16_t size = decode16(&ptr);
+            add_free_block(page_id, over_page, off, size);
+            off = next_off;
+        }
+        prev_page_id = page_id;
         page_id = over_page.next_page_id;
     }
+    // 重建空闲页时需要知道哪些页是共享溢出页
+    load_free_map();
 }
 
 void page_manager::clear()
 {
     over_page_map.clear();
-    avail_map.clear();
+    size_classes.assign(max_size_classes, {});
+    pending_blocks.clear();
+    fresh_over_pages.clear();
+    std::vector<std::shared_ptr<alloc_cache>> list;
+    {
+        lock_t lk(free_latch);
+        free_extents.clear();
+        list.swap(caches);
+        cache_id = next_cache_id++;
+    }
+    // 线程中缓存的旧的alloc_cache要等到它下一次调用local_cache()时才会被丢弃，
+    // 在此之前先清空其中的页，它们不能再被分配出去了
+    for (auto& cache : list) {
+        lock_t lk(cache->latch);
+        std::vector<page_id_t>().swap(cache->pages);
+        std::vector<page_id_t>().swap(cache->freed);
+        cache->detached = true;
+    }
 }
 
 // 分配一个新页，有3种用途：
 // 1) 分配给一个B+树中的节点
 // 2) 分配给一个很大的value存放溢出的值，并且它能占满整页
 // 3) 一个value溢出的值不能占满整页，此时我们将管理所有这些未用完的页
+// 空闲页都在内存中，分配和释放都不需要读写磁盘
 page_id_t page_manager::alloc_page()
 {
-    recursive_lock_t lk(db->header_latch);
-    page_id_t page_id = db->header.free_list_head;
-    if (db->header.free_pages > 0) {
-        db->header.free_pages--;
-        lseek(db->fd, page_id, SEEK_SET);
-        read(db->fd, &db->header.free_list_head, sizeof(db->header.free_list_head));
-    } else {
-        db->header.free_list_head += db->header.page_size;
-    }
+    auto& cache = local_cache();
+    lock_t lk(cache.latch);
+    if (cache.pages.empty()) refill(cache);
+    page_id_t page_id = cache.pages.back();
+    cache.pages.pop_back();
     return page_id;
 }
 
 #define ASSERT_PAGE_ID(page_id) (assert(page_id > 0))
 
-// 所有空闲页会用一个链表串起来，释放一页只是简单的将它插到空闲链表头部
-// ---------------------------------------
-// |       8 bytes     | xxxxxxxxxxxxxxx |
-// | next-free-page-id | xxxxxxxxxxxxxxx |
-// ---------------------------------------
 void page_manager::free_page(page_id_t page_id)
 {
     ASSERT_PAGE_ID(page_id);
-    recursive_lock_t lk(db->header_latch);
-    lseek(db->fd, page_id, SEEK_SET);
-    write(db->fd, &db->header.free_list_head, sizeof(db->header.free_list_head));
-    db->header.free_list_head = page_id;
-    db->header.free_pages++;
+    auto& cache = local_cache();
+    lock_t lk(cache.latch);
+    cache.freed.push_back(page_id);
+}
+
+page_manager::alloc_cache& page_manager::local_cache()
+{
+    // 同一个进程中可能打开了多个数据库，所以要按cache_id区分
+    // 线程退出时把它的alloc_cache都标记为orphaned，见check_point()
+    struct cache_map : std::unordered_map<uint64_t, std::shared_ptr<alloc_cache>> {
+        ~cache_map()
+        {
+            for (auto& [id, cache] : *this) cache->orphaned = true;
+        }
+    };
+    static thread_local cache_map local_caches;
+    auto it = local_caches.find(cache_id);
+    if (it != local_caches.end()) return *it->second;
+    for (auto it = local_caches.begin(); it != local_caches.end(); ) {
+        if (it->second->detached) it = local_caches.erase(it);
+        else ++it;
+    }
+    auto cache = std::make_shared<alloc_cache>();
+    local_caches.emplace(cache_id, cache);
+    lock_t lk(free_latch);
+    caches.push_back(cache);
+    return *cache;
+}
+
+// 从free_extents的最前面取出一批页，没有空闲页时就从文件末尾分配
+// 页按降序放入缓存，这样同一个线程会按顺序分配到相邻的页
+void page_manager::refill(alloc_cache& cache)
+{
+    lock_t lk(free_latch);
+    size_t page_size = db->header.page_size;
+    std::vector<page_id_t> pages;
+    while (pages.size() < alloc_batch && !free_extents.empty()) {
+        auto it = free_extents.begin();
+        auto [page_id, n] = *it;
+        size_t take = std::min(n, alloc_batch - pages.size());
+        for (size_t i = 0; i < take; i++) {
+            pages.push_back(page_id + i * page_size);
+        }
+        free_extents.erase(it);
+        if (take < n) free_extents.emplace(page_id + take * page_size, n - take);
+    }
+    if (pages.empty()) {
+        pages.push_back(high_water);
+        high_water += page_size;
+    }
+    cache.pages.assign(pages.rbegin(), pages.rend());
+}
+
+// 加入[page_id, page_id + n)，并与前后相邻的区间合并
+void page_manager::add_extent(extent_map& extents, page_id_t page_id, size_t n)
+{
+    size_t page_size = db->header.page_size;
+    auto next = extents.lower_bound(page_id);
+    if (next != extents.end() && page_id + (off_t)(n * page_size) == next->first) {
+        n += next->second;
+        next = extents.erase(next);
+    }
+    if (next != extents.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + (off_t)(prev->second * page_size) == page_id) {
+            prev->second += n;
+            return;
+        }
+    }
+    extents.emplace(page_id, n);
+}
+
+void page_manager::drain_caches()
+{
+    std::vector<std::shared_ptr<alloc_cache>> list;
+    {
+        lock_t lk(free_latch);
+        list = caches;
+    }
+    for (auto& cache : list) {
+        lock_t lk(cache->latch);
+        lock_t flk(free_latch);
+        for (auto page_id : cache->pages) {
+            add_extent(free_extents, page_id, 1);
+        }
+        cache->pages.clear();
+    }
+}
+
+bool page_manager::has_free_pages()
+{
+    lock_t lk(free_latch);
+    return !free_extents.empty();
+}
+
+page_id_t page_manager::alloc_below(page_id_t limit)
+{
+    lock_t lk(free_latch);
+    if (free_extents.empty()) return 0;
+    auto it = free_extents.begin();
+    auto [page_id, n] = *it;
+    if (page_id >= limit) return 0;
+    free_extents.erase(it);
+    if (n > 1) free_extents.emplace(page_id + db->header.page_size, n - 1);
+    return page_id;
+}
+
+// 取第一个足够大的空闲区间
+page_id_t page_manager::alloc_run(size_t n, bool grow)
+{
+    lock_t lk(free_latch);
+    size_t page_size = db->header.page_size;
+    for (auto it = free_extents.begin(); it != free_extents.end(); ++it) {
+        auto [page_id, pages] = *it;
+        if (pages < n) continue;
+        free_extents.erase(it);
+        if (pages > n) free_extents.emplace(page_id + (off_t)(n * page_size), pages - n);
+        return page_id;
+    }
+    if (!grow) return 0;
+    page_id_t page_id = high_water;
+    // 紧挨着high_water的空闲区间也可以用上
+    if (!free_extents.empty()) {
+        auto last = std::prev(free_extents.end());
+        if (last->first + (off_t)(last->second * page_size) == high_water) {
+            page_id = last->first;
+            free_extents.erase(last);
+        }
+    }
+    high_water = page_id + (off_t)(n * page_size);
+    return page_id;
+}
+
+page_id_t page_manager::trim()
+{
+    lock_t lk(free_latch);
+    while (!free_extents.empty()) {
+        auto it = std::prev(free_extents.end());
+        if (it->first + (off_t)(it->second * db->header.page_size) != high_water) break;
+        high_water = it->first;
+        free_extents.erase(it);
+    }
+    return high_water;
+}
+
+std::vector<std::pair<page_id_t, size_t>> page_manager::free_runs(size_t n)
+{
+    std::vector<std::pair<page_id_t, size_t>> runs;
+    lock_t lk(free_latch);
+    for (auto& [page_id, pages] : free_extents) {
+        if (pages >= n) runs.emplace_back(page_id, pages);
+    }
+    return runs;
+}
+
+// ########################### freemap ###########################
+// [high-water][extent-nums][<page-id, n>...][check-point-seq]
+// 它总是先于header写入，以免header中的high-water比它的还新
+// 两者之间崩溃时，freemap中的check-point-seq会比header中的新，加载时就要重建空闲页
+void page_manager::check_point()
+{
+    // 此时所有修改操作都已被阻塞，不会再有页被分配或释放
+    // 新的header落盘之后，这段时间内释放的块和页就不再被引用了，它们在新的镜像中都是空闲的
+    // 释放块时会原地修改溢出页，所以先释放块，整页空出来的溢出页也会一起释放
+    {
+        lock_t lk(latch);
+        for (auto [page_id, freep, n] : pending_blocks) {
+            free_block(page_id, freep, n);
+        }
+        pending_blocks.clear();
+        fresh_over_pages.clear();
+    }
+    // 加锁顺序总是先alloc_cache::latch再free_latch
+    std::vector<std::shared_ptr<alloc_cache>> list;
+    {
+        lock_t lk(free_latch);
+        list = caches;
+    }
+    std::vector<page_id_t> cached;
+    for (auto& cache : list) {
+        lock_t lk(cache->latch);
+        {
+            lock_t lk(free_latch);
+            for (auto page_id : cache->freed) {
+                add_extent(free_extents, page_id, 1);
+            }
+        }
+        cache->freed.clear();
+        // 线程已经退出了，它缓存的页就还给free_extents
+        if (cache->orphaned) {
+            lock_t lk(free_latch);
+            for (auto page_id : cache->pages) {
+                add_extent(free_extents, page_id, 1);
+            }
+            cache->pages.clear();
+            caches.erase(std::find(caches.begin(), caches.end(), cache));
+        } else {
+            cached.insert(cached.end(), cache->pages.begin(), cache->pages.end());
+        }
+    }
+    extent_map extents;
+    {
+        lock_t lk(free_latch);
+        extents = free_extents;
+        db->header.free_list_head = high_water;
+    }
+    for (auto page_id : cached) {
+        add_extent(extents, page_id, 1);
+    }
+    size_t free_pages = 0;
+    for (auto& [page_id, n] : extents) {
+        free_pages += n;
+    }
+    db->header.free_pages = free_pages;
+    db->header.check_point_seq++;
+    save_free_map(extents);
+}
+
+void page_manager::save_free_map(const extent_map& extents)
+{
+    std::string buf;
+    encode64(buf, db->header.free_list_head);
+    encode64(buf, extents.size());
+    for (auto& [page_id, n] : extents) {
+        encode_page_id(buf, page_id);
+        encode64(buf, n);
+    }
+    encode64(buf, db->header.check_point_seq);
+    auto name = db->dbname + "freemap";
+    auto tmpname = name + ".tmp";
+    int fd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        panic("page_manager: open(%s): %s", tmpname.c_str(), strerror(errno));
+    }
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+        panic("page_manager: write(%s): %s", tmpname.c_str(), strerror(errno));
+    }
+    sync_fd(fd);
+    close(fd);
+    rename(tmpname.c_str(), name.c_str());
+}
+
+void page_manager::load_free_map()
+{
+    auto name = db->dbname + "freemap";
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        // 还没有做过check-point的新数据文件中没有空闲页
+        if (db->header.check_point_seq == 0) high_water = db->header.free_list_head;
+        else rebuild_free_list();
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    std::string buf(st.st_size, 0);
+    if (read(fd, &buf[0], buf.size()) != (ssize_t)buf.size()) {
+        panic("page_manager: read(%s): %s", name.c_str(), strerror(errno));
+    }
+    close(fd);
+    char *ptr = &buf[0];
+    high_water = decode64(&ptr);
+    size_t n = decode64(&ptr);
+    for (size_t i = 0; i < n; i++) {
+        page_id_t page_id = decode_page_id(&ptr);
+        size_t pages = decode64(&ptr);
+        free_extents.emplace(page_id, pages);
+    }
+    uint64_t check_point_seq = decode64(&ptr);
+    if (check_point_seq != db->header.check_point_seq) {
+        free_extents.clear();
+        rebuild_free_list();
+    }
+}
+
+// freemap和header不是同一次check-point写入的，我们就遍历B+树和溢出页找出所有在用的页，
+// 其余的页都是空闲的
+void page_manager::rebuild_free_list()
+{
+    size_t page_size = db->header.page_size;
+    struct stat st;
+    fstat(db->fd, &st);
+    // 较新的那次check-point可能已经写入了header中的high-water之后的页
+    page_id_t file_end = (st.st_size + page_size - 1) / page_size * page_size;
+    high_water = std::max<page_id_t>(db->header.free_list_head, file_end);
+    std::vector<page_id_t> pages;
+    if (db->header.root_id > 0) db->translation_table.used_pages(db->header.root_id, pages);
+    for (auto& [page_id, over_page] : over_page_map) {
+        pages.push_back(page_id);
+    }
+    // 第0页是header
+    std::vector<bool> used(high_water / page_size, false);
+    used[0] = true;
+    for (auto page_id : pages) {
+        if (page_id < high_water) used[page_id / page_size] = true;
+    }
+    for (size_t i = 1; i < used.size(); i++) {
+        if (!used[i]) add_extent(free_extents, i * page_size, 1);
+    }
 }
 
 #define OVER_PAGE_AVAIL_OFF (sizeof(page_id_t) + 2 + 2)
@@ -81,145 +405,141 @@ inline uint16_t round4(uint16_t n)
     return (ceil(n / 4.0) * 4);
 }
 
+// 大小为size的块所在的级别
+inline int size_class(uint16_t size)
+{
+    return 31 - __builtin_clz(size);
+}
+
 // 向某个共享溢出页内写入data[n]，并返回写入的溢出页的首地址和页内写入的偏移位置
 // -----------------------------------------------------
 // |      8 bytes      |    2 bytes  |     2 bytes     |
 // | next-over-page-id |  avail-size | free-block-head |
 // -----------------------------------------------------
-// 页内的空闲块也以链表的形式串连起来，管理方式类似于基于显式空闲链表的内存分配器实现
+// 页内的空闲块也以链表的形式串连起来，按偏移升序排列
 // -----------------------------------------
 // |      2 bytes        |     2 bytes     |
 // | next-free-block-off | free-block-size |
 // -----------------------------------------
+// 所有空闲块都按大小分级保存在内存中(segregated-fit)，
+// 比round_n所在的级别更高的级别中的任意一块都放得下，所以不必逐页查找，
+// 写入时也只需读写这一页
 over_page_id_t page_manager::write_over_page(const char *data, uint16_t n)
 {
     ASSERT_AVAIL(n);
     uint16_t round_n = round4(n); // n会被向上取整到4的倍数
     lock_t lk(latch);
-    auto it = avail_map.lower_bound(round_n);
-    if (it == avail_map.end()) { // 没有找到剩余可用大小至少为round_n的页
-        return write_new_over_page(data, n);
-    }
-    for ( ; it != avail_map.end(); ++it) {
-        for (auto& page_id : it->second) {
-            uint16_t freep = search_and_try_write(page_id, data, n);
-            if (freep > 0) {
-                page_id_t id = page_id;
-                std::swap(page_id, it->second.back());
-                it->second.pop_back();
-                if (it->second.empty()) avail_map.erase(it->first);
-                return { id, freep };
-            }
+    int k = size_class(round_n);
+    if (round_n & (round_n - 1)) {
+        // round_n所在的那一级中只有一部分块放得下，我们只看前面几个
+        int probes = 0;
+        for (auto [page_id, off] : size_classes[k]) {
+            if (over_page_map[page_id].free_blocks[off] >= round_n)
+                return write_into_block(page_id, off, data, n);
+            if (++probes == max_probes) break;
         }
+        k++;
     }
-    // 所有页内都没有找到合适的空闲块
+    for ( ; k < max_size_classes; k++) {
+        if (size_classes[k].empty()) continue;
+        auto [page_id, off] = *size_classes[k].begin();
+        return write_into_block(page_id, off, data, n);
+    }
+    // 没有找到剩余可用大小至少为round_n的块
     return write_new_over_page(data, n);
 }
 
+// 将data[n]写入空闲块page_id:off的开头，剩下的部分仍作为一个空闲块
+over_page_id_t page_manager::write_into_block(page_id_t page_id, uint16_t off, const char *data, uint16_t n)
+{
+    uint16_t round_n = round4(n);
+    auto& over_page = over_page_map[page_id];
+    uint16_t size = over_page.free_blocks[off];
+    remove_free_block(page_id, over_page, off);
+    if (size > round_n) {
+        add_free_block(page_id, over_page, off + round_n, size - round_n);
+    }
+    over_page.avail -= round_n;
+    write_block(page_id, off, data, n);
+    return { page_id, off };
+}
+
 // 分配一个新页，并写入data[n]
 over_page_id_t page_manager::write_new_over_page(const char *data, uint16_t n)
 {
     page_id_t page_id = alloc_page();
     db->lock_header();
-    // 因为如果mmap()映射的区域超出了文件大小，那么我们读写超出的区域就是非法的
-    // 所以如有必要，我们需要事先增长文件大小
-    struct stat st;
-    fstat(db->fd, &st);
-    if (page_id + db->header.page_size > st.st_size)
-        ftruncate(db->fd, page_id + db->header.page_size);
     uint16_t round_n = round4(n);
     db->header.over_pages++;
-    lseek(db->fd, page_id, SEEK_SET);
-    over_page_info over_page;
+    auto& over_page = over_page_map[page_id];
     over_page.prev_page_id = 0;
     over_page.next_page_id = db->header.over_page_list_head;
     over_page.avail = db->header.page_size - OVER_PAGE_AVAIL_OFF - round_n;
-    over_page.free_block_head = OVER_PAGE_AVAIL_OFF + round_n;
     db->header.over_page_list_head = page_id;
     db->unlock_header();
-    struct iovec iov[7];
-    iov[0].iov_base = &over_page.next_page_id;
-    iov[0].iov_len = sizeof(over_page.next_page_id);
-    iov[1].iov_base = &over_page.avail;
-    iov[1].iov_len = sizeof(over_page.avail);
-    iov[2].iov_base = &over_page.free_block_head;
-    iov[2].iov_len = sizeof(over_page.free_block_head);
-    iov[3].iov_base = const_cast<char*>(data);
-    iov[3].iov_len = n;
-    std::string zeros(round_n - n, '\0');
-    iov[4].iov_base = const_cast<char*>(zeros.data());
-    iov[4].iov_len = zeros.size();
-    uint16_t next_free_block_off = 0;
-    iov[5].iov_base = &next_free_block_off;
-    iov[5].iov_len = sizeof(next_free_block_off);
-    iov[6].iov_base = &over_page.avail;
-    iov[6].iov_len = sizeof(over_page.avail);
-    writev(db->fd, iov, 7);
+    fresh_over_pages.insert(page_id);
+    // 剩下的部分作为第一个空闲块
+    if (over_page.avail > 0) {
+        add_free_block(page_id, over_page, OVER_PAGE_AVAIL_OFF + round_n, over_page.avail);
+    }
+    page_frame frame(db->page_io);
+    char *buf = frame.data();
+    memset(buf, 0, db->header.page_size);
+    memcpy(buf, &over_page.next_page_id, sizeof(over_page.next_page_id));
+    memcpy(buf + OVER_PAGE_AVAIL_OFF, data, n);
+    encode_free_blocks(buf, over_page);
+    db->page_io.write_page(page_id, buf);
 
     if (over_page.next_page_id > 0) {
         over_page_map[over_page.next_page_id].prev_page_id = page_id;
     }
-    over_page_map.emplace(page_id, over_page);
-    avail_map[over_page.avail].push_back(page_id);
     return { page_id, OVER_PAGE_AVAIL_OFF };
 }
 
-// 在溢出页page_id内查找是否有长度至少为n的空闲块
-// 如果有的话，我们写入data[n]，并返回写入位置的页内偏移；否则就返回0
-uint16_t page_manager::search_and_try_write(page_id_t page_id, const char *data, uint16_t n)
+// 将data[n]写入溢出页page_id的off处，同时更新页内的空闲块链表，调用者需持有latch
+void page_manager::write_block(page_id_t page_id, uint16_t off, const char *data, uint16_t n)
 {
-    uint16_t round_n = round4(n);
-    auto& over_page = over_page_map[page_id];
-    // 我们这里使用PROT_WRITE以便直接修改溢出页
-    void *start = mmap(nullptr, db->header.page_size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, page_id);
-    if (start == MAP_FAILED) {
-        panic("search_and_try_write: load page failed from page_id=%lld: %s", page_id, strerror(errno));
-    }
-    char *buf = reinterpret_cast<char*>(start);
-    uint16_t prev_off = 0;
-    uint16_t cur_off = over_page.free_block_head;
-    uint16_t avail = over_page.avail;
-    while (true) {
-        char *ptr = buf + cur_off;
-        uint16_t next_off = decode16(&ptr);
-        uint16_t cur_size = decode16(&ptr);
-        if (cur_size >= round_n) { // 找到了一个合适的块
-            // 将data[n]拷贝到cur_off处
-            memcpy(buf + cur_off, data, n);
-            // 如果还有剩余的，我们就将它插回到原空闲块链表中
-            uint16_t remain_size = cur_size - round_n;
-            if (remain_size > 0) {
-                uint16_t new_off = cur_off + round_n;
-                memcpy(buf + new_off, &next_off, sizeof(next_off));
-                memcpy(buf + new_off + 2, &remain_size, sizeof(remain_size));
-                next_off = new_off;
-            }
-            // 更新前一个块的next-free-block-off信息
-            if (prev_off > 0)
-                memcpy(buf + prev_off, &next_off, sizeof(next_off));
-            else
-                over_page.free_block_head = next_off;
-            // 更新该页的剩余可用大小
-            over_page.avail -= round_n;
-            if (over_page.avail > 0) {
-                avail_map[over_page.avail].push_back(page_id);
-            }
-            // 更新该页的相关记录信息
-            memcpy(buf + sizeof(page_id_t), &over_page.avail, sizeof(over_page.avail));
-            memcpy(buf + sizeof(page_id_t) + 2, &over_page.free_block_head, sizeof(over_page.free_block_head));
-            break;
-        }
-        avail -= cur_size;
-        // 剩下的块中已经找不到合适的了
-        if (avail < round_n) {
-            cur_off = 0;
-            break;
-        }
-        prev_off = cur_off;
-        cur_off = next_off;
+    journal_over_page(page_id);
+    page_frame frame(db->page_io);
+    db->page_io.read_page(page_id, frame.data());
+    memcpy(frame.data() + off, data, n);
+    encode_free_blocks(frame.data(), over_page_map[page_id]);
+    db->page_io.write_page(page_id, frame.data());
+}
+
+// 按内存中的空闲块重写页内的avail-size, free-block-head和空闲块链表
+void page_manager::encode_free_blocks(char *buf, over_page_info& over_page)
+{
+    auto& blocks = over_page.free_blocks;
+    uint16_t head = blocks.empty() ? 0 : blocks.begin()->first;
+    memcpy(buf + sizeof(page_id_t), &over_page.avail, sizeof(over_page.avail));
+    memcpy(buf + sizeof(page_id_t) + 2, &head, sizeof(head));
+    for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+        auto next = std::next(it);
+        uint16_t next_off = next == blocks.end() ? 0 : next->first;
+        memcpy(buf + it->first, &next_off, sizeof(next_off));
+        memcpy(buf + it->first + 2, &it->second, sizeof(it->second));
     }
-    munmap(start, db->header.page_size);
-    return cur_off;
+}
+
+void page_manager::add_free_block(page_id_t page_id, over_page_info& over_page, uint16_t off, uint16_t size)
+{
+    over_page.free_blocks[off] = size;
+    size_classes[size_class(size)].emplace(page_id, off);
+}
+
+void page_manager::remove_free_block(page_id_t page_id, over_page_info& over_page, uint16_t off)
+{
+    auto it = over_page.free_blocks.find(off);
+    size_classes[size_class(it->second)].erase({ page_id, off });
+    over_page.free_blocks.erase(it);
+}
+
+// 上一次check-point时就存在的溢出页在原地修改之前要先记入journal
+// 溢出页只在flush()中写入和释放，此时持有journal_mtx；bulk_loader只会写入它自己新分配的溢出页
+void page_manager::journal_over_page(page_id_t page_id)
+{
+    if (!fresh_over_pages.count(page_id)) db->translation_table.journal(page_id);
 }
 
 // 释放溢出页page_id内偏移为freep处的n个字节
@@ -227,100 +547,62 @@ void page_manager::free_over_page(page_id_t page_id, uint16_t freep, uint16_t n)
 {
     ASSERT_PAGE_ID(page_id);
     lock_t lk(latch);
+    pending_blocks.emplace_back(page_id, freep, n);
+}
+
+// 调用者需持有latch
+void page_manager::free_block(page_id_t page_id, uint16_t freep, uint16_t n)
+{
     auto& over_page = over_page_map[page_id];
     ASSERT_AVAIL(over_page.avail + n);
     n = round4(n);
     over_page.avail += n;
     if (over_page.avail == db->header.page_size - OVER_PAGE_AVAIL_OFF) {
         // 如果该页没人使用了，就整个释放掉
+        while (!over_page.free_blocks.empty()) {
+            remove_free_block(page_id, over_page, over_page.free_blocks.begin()->first);
+        }
         recursive_lock_t lk(db->header_latch);
         if (over_page.prev_page_id > 0) {
-            lseek(db->fd, over_page.prev_page_id, SEEK_SET);
-            write(db->fd, &over_page.next_page_id, sizeof(over_page.next_page_id));
+            journal_over_page(over_page.prev_page_id);
+            page_frame frame(db->page_io);
+            db->page_io.read_page(over_page.prev_page_id, frame.data());
+            memcpy(frame.data(), &over_page.next_page_id, sizeof(over_page.next_page_id));
+            db->page_io.write_page(over_page.prev_page_id, frame.data());
+            over_page_map[over_page.prev_page_id].next_page_id = over_page.next_page_id;
         } else {
             db->header.over_page_list_head = over_page.next_page_id;
         }
+        if (over_page.next_page_id > 0) {
+            over_page_map[over_page.next_page_id].prev_page_id = over_page.prev_page_id;
+        }
         db->header.over_pages--;
-        remove_by_avail(page_id, over_page.avail);
         over_page_map.erase(page_id);
         free_page(page_id);
         return;
     }
-    remove_by_avail(page_id, over_page.avail);
-    void *start = mmap(nullptr, db->header.page_size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, page_id);
-    if (start == MAP_FAILED) {
-        panic("free_over_page: load page failed from page_id=%lld: %s", page_id, strerror(errno));
-    }
-    char *buf = reinterpret_cast<char*>(start);
-    uint16_t cur_off = over_page.free_block_head;
-    uint16_t prev_off = 0;
-    uint16_t prev_size = 0;
-    char *ptr = buf + cur_off;
-    uint16_t next_off = decode16(&ptr);
-    uint16_t cur_size = decode16(&ptr);
-    if (cur_off == 0) { // 第一个被释放的块
-        uint16_t next_off = 0;
-        memcpy(buf + freep, &next_off, sizeof(next_off));
-        memcpy(buf + freep + 2, &n, sizeof(n));
-        over_page.free_block_head = freep;
-        goto end;
-    }
-    // 找到合适的插入位置，按偏移地址升序插入
-    while (cur_off < freep && next_off > 0) {
-        prev_off = cur_off;
-        prev_size = cur_size;
-        cur_off = next_off;
-        ptr = buf + cur_off;
-        next_off = decode16(&ptr);
-        cur_size = decode16(&ptr);
-    }
-    // 释放并尝试合并相邻块
-    if (freep < cur_off) {
-        if (freep + n == cur_off) {
-            n += cur_size;
-            memcpy(buf + freep, &next_off, sizeof(next_off));
-            memcpy(buf + freep + 2, &n, sizeof(n));
-            if (prev_off + prev_size == freep) {
-                prev_size += n;
-                memcpy(buf + prev_off, &next_off, sizeof(next_off));
-                memcpy(buf + prev_off + 2, &prev_size, sizeof(prev_size));
-            }
-        } else {
-            memcpy(buf + freep, &cur_off, sizeof(cur_off));
-            memcpy(buf + freep + 2, &n, sizeof(n));
-            if (prev_off + prev_size == freep) {
-                prev_size += n;
-                memcpy(buf + prev_off + 2, &prev_size, sizeof(prev_size));
-            }
-        }
-        if (prev_off == 0) over_page.free_block_head = freep;
-    } else {
-        if (cur_off + cur_size == freep) {
-            cur_size += n;
-            memcpy(buf + cur_off + 2, &cur_size, sizeof(cur_size));
-        } else {
-            memcpy(buf + cur_off, &freep, sizeof(freep));
-            memcpy(buf + freep, &next_off, sizeof(next_off));
-            memcpy(buf + freep + 2, &n, sizeof(n));
-        }
+    // 与前后相邻的空闲块合并
+    auto& blocks = over_page.free_blocks;
+    auto next = blocks.lower_bound(freep);
+    if (next != blocks.end() && freep + n == next->first) {
+        n += next->second;
+        remove_free_block(page_id, over_page, next->first);
     }
-end:
-    memcpy(buf + sizeof(page_id_t), &over_page.avail, sizeof(over_page.avail));
-    memcpy(buf + sizeof(page_id_t) + 2, &over_page.free_block_head, sizeof(over_page.free_block_head));
-    avail_map[over_page.avail].push_back(page_id);
-    munmap(start, db->header.page_size);
-}
-
-void page_manager::remove_by_avail(page_id_t page_id, uint16_t avail)
-{
-    auto& page_list = avail_map[avail];
-    for (auto it = page_list.begin(); it != page_list.end(); ++it) {
-        if (*it == page_id) {
-            page_list.erase(it);
-            break;
+    next = blocks.lower_bound(freep);
+    if (next != blocks.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == freep) {
+            freep = prev->first;
+            n += prev->second;
+            remove_free_block(page_id, over_page, freep);
         }
     }
-    if (page_list.empty()) avail_map.erase(avail);
+    add_free_block(page_id, over_page, freep, n);
+    journal_over_page(page_id);
+    page_frame frame(db->page_io);
+    db->page_io.read_page(page_id, frame.data());
+    encode_free_blocks(frame.data(), over_page);
+    db->page_io.write_page(page_id, frame.data());
 }
 
 } // namespace bpdb
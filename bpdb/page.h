@@ -2,8 +2,12 @@
 #define __BPDB_PAGE_H
 
 #include <map>
+#include <set>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <tuple>
+#include <memory>
 #include <mutex>
 
 #include "common.h"
@@ -17,28 +21,87 @@ typedef std::pair<page_id_t, uint16_t> over_page_id_t;
 class page_manager {
 public:
     page_manager(DB *db) : db(db) {  }
+    ~page_manager();
     page_manager(const page_manager&) = delete;
     page_manager& operator=(const page_manager&) = delete;
     void init();
     page_id_t alloc_page();
+    // 释放的页在上一次check-point的镜像中可能还在使用，所以要等到下一次check-point时才能再分配出去，
+    // 否则崩溃后用journal还原的镜像就会引用被覆盖了的页
     void free_page(page_id_t page_id);
     over_page_id_t write_over_page(const char *data, uint16_t n);
+    // 和free_page()一样推迟到下一次check-point时才真正释放
     void free_over_page(page_id_t page_id, uint16_t freep, uint16_t n);
+    // 在check-point时调用，释放这段时间内被释放的页和溢出页中的块，
+    // 然后将空闲页写入freemap文件，并更新header中的相关字段，调用者需持有journal_mtx
+    void check_point();
+    // 以下只在check-point期间由DB::compact()和DB::recluster()调用，此时不会有页被并发地分配或释放
+    // 将所有线程缓存的页归还给free_extents，这次check-point之后释放的页不在其中
+    void drain_caches();
+    bool has_free_pages();
+    // 分配一个小于limit的最小的空闲页，没有时返回0
+    page_id_t alloc_below(page_id_t limit);
+    // 分配n个连续的空闲页，返回第一页，没有时返回0
+    // grow为true时可以从文件末尾分配，bulk_loader也用它来为叶节点成段地分配页
+    page_id_t alloc_run(size_t n, bool grow);
+    // 丢弃文件末尾的空闲页，返回新的文件大小
+    page_id_t trim();
+    // 返回不少于n页的空闲区间<起始页, 页数>
+    std::vector<std::pair<page_id_t, size_t>> free_runs(size_t n);
 private:
     DB *db;
     void clear();
+    // 每个线程缓存的空闲页，分配和释放通常只需访问自己的缓存
+    struct alloc_cache {
+        std::mutex latch;
+        std::vector<page_id_t> pages;
+        // 这次check-point之后释放的页，见free_page()
+        std::vector<page_id_t> freed;
+        // 数据库被关闭或重新init()了，线程下一次调用local_cache()时会丢弃它，见clear()
+        std::atomic_bool detached = false;
+        // 所属的线程已经退出了，下一次check-point时它缓存的页会还给free_extents
+        std::atomic_bool orphaned = false;
+    };
+    typedef std::map<page_id_t, size_t> extent_map;
+    alloc_cache& local_cache();
+    void refill(alloc_cache& cache);
+    void add_extent(extent_map& extents, page_id_t page_id, size_t n);
+    void load_free_map();
+    void rebuild_free_list();
+    void save_free_map(const extent_map& extents);
+    // 空闲页按<起始页, 页数>保存，相邻的空闲页会被合并，分配时总是从最前面取
+    extent_map free_extents;
+    // 文件末尾第一个还未分配过的页，即header.free_list_head
+    page_id_t high_water = 0;
+    std::vector<std::shared_ptr<alloc_cache>> caches;
+    // 每次init()都会得到一个新的id，线程中缓存的旧的alloc_cache就作废了
+    uint64_t cache_id = 0;
+    // 保护free_extents, high_water和caches
+    std::mutex free_latch;
     // 加快查找header.over_page_list_head
     struct over_page_info {
         page_id_t prev_page_id;
         page_id_t next_page_id;
         uint16_t avail;
-        uint16_t free_block_head;
+        // 页内的空闲块<off, size>，按偏移排序以便释放时合并相邻的块
+        // 它和页内的空闲块链表是一致的，分配时就不必读盘查找了
+        std::map<uint16_t, uint16_t> free_blocks;
     };
     over_page_id_t write_new_over_page(const char *data, uint16_t n);
-    uint16_t search_and_try_write(page_id_t page_id, const char *data, uint16_t n);
-    void remove_by_avail(page_id_t page_id, uint16_t avail);
+    over_page_id_t write_into_block(page_id_t page_id, uint16_t off, const char *data, uint16_t n);
+    void write_block(page_id_t page_id, uint16_t off, const char *data, uint16_t n);
+    void free_block(page_id_t page_id, uint16_t freep, uint16_t n);
+    void journal_over_page(page_id_t page_id);
+    void encode_free_blocks(char *buf, over_page_info& over_page);
+    void add_free_block(page_id_t page_id, over_page_info& over_page, uint16_t off, uint16_t size);
+    void remove_free_block(page_id_t page_id, over_page_info& over_page, uint16_t off);
     std::unordered_map<page_id_t, over_page_info> over_page_map;
-    std::map<uint16_t, std::vector<page_id_t>> avail_map;
+    // 按大小分级的空闲块<page-id, off>，第k级中块的大小在[2^k, 2^(k+1))之间
+    std::vector<std::set<std::pair<page_id_t, uint16_t>>> size_classes;
+    // 还未释放的块<page-id, off, n>，见free_over_page()
+    std::vector<std::tuple<page_id_t, uint16_t, uint16_t>> pending_blocks;
+    // 这次check-point之后新分配的共享溢出页，它们不在上一次check-point的镜像中，原地修改前不必记入journal
+    std::unordered_set<page_id_t> fresh_over_pages;
     // 1) 保护相应的内存数据结构
     // 2) 间接保证不会同时修改同一个shared-over-page
     std::mutex latch;
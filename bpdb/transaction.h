@@ -93,7 +93,7 @@ private:
     // 阻塞生成新事务
     std::atomic_bool blocking = false;
     transaction_locker locker;
-    versions versions;
+    bpdb::versions versions;
     friend class transaction;
 };
 }
@@ -1,3 +1,5 @@
+#include <assert.h>
+
 #include "transaction_lock.h"
 
 namespace bpdb {
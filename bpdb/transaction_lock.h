@@ -4,6 +4,9 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 #include "common.h"
 
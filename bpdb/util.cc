@@ -1,8 +1,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "util.h"
 #include "config.h"
 
+#if defined (__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace bpdb {
 
 int sync_fd(int fd)
@@ -20,4 +25,57 @@ int sync_fd(int fd)
     return ::fsync(fd);
 #endif
 }
+
+// 无分支的二分查找，循环中的比较会被编译为cmov
+// 结束时第一个不小于key的元素一定在[base, base + len]中
+static const uint64_t *narrow(const uint64_t *base, int& len, int min_len, uint64_t key)
+{
+    while (len > min_len) {
+        int half = len / 2;
+        base = base[half] < key ? base + half : base;
+        len -= half;
+    }
+    return base;
+}
+
+int lower_bound_u64_scalar(const uint64_t *a, int n, uint64_t key)
+{
+    if (n == 0) return 0;
+    int len = n;
+    const uint64_t *base = narrow(a, len, 1, key);
+    return (base - a) + (*base < key);
+}
+
+#if defined (BPDB_AVX2_SEARCH)
+// 先二分到只剩不超过16个元素，再用SIMD数出其中小于key的元素个数
+// AVX2只有有符号的64位比较，所以两边都要先翻转符号位
+__attribute__((target("avx2")))
+int lower_bound_u64_avx2(const uint64_t *a, int n, uint64_t key)
+{
+    int len = n;
+    const uint64_t *base = narrow(a, len, 16, key);
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+    int count = 0, i = 0;
+    for ( ; i + 4 <= len; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i));
+        __m256i lt = _mm256_cmpgt_epi64(k, _mm256_xor_si256(v, sign));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    for ( ; i < len; i++) {
+        count += base[i] < key;
+    }
+    return (base - a) + count;
+}
+#endif
+
+int lower_bound_u64(const uint64_t *a, int n, uint64_t key)
+{
+#if defined (BPDB_AVX2_SEARCH)
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) return lower_bound_u64_avx2(a, n, key);
+#endif
+    return lower_bound_u64_scalar(a, n, key);
 }
+
+} // namespace bpdb
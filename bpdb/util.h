@@ -1,11 +1,26 @@
 #ifndef __BPDB_UTIL_H
 #define __BPDB_UTIL_H
 
+#include <stdint.h>
+
 namespace bpdb {
 
 // return 0 if ok
 int sync_fd(int fd);
 
+// 返回有序数组a[0, n)中第一个不小于key的元素的下标
+// 支持AVX2的CPU上会用SIMD比较最后的一小段
+int lower_bound_u64(const uint64_t *a, int n, uint64_t key);
+
+// lower_bound_u64()的两种实现，测试中会分别调用它们
+int lower_bound_u64_scalar(const uint64_t *a, int n, uint64_t key);
+#if defined (__x86_64__) && (defined (__GNUC__) || defined (__clang__))
+#define BPDB_AVX2_SEARCH
+// 调用者要先确认CPU支持AVX2
+__attribute__((target("avx2")))
+int lower_bound_u64_avx2(const uint64_t *a, int n, uint64_t key);
+#endif
+
 }
 
 #endif // __BPDB_UTIL_H
@@ -0,0 +1,305 @@
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "codec.h"
+#include "util.h"
+
+namespace bpdb {
+
+// 超过max_write_buf后就write()出去，读取时不必在缓冲区中查找太久
+static const size_t max_write_buf = 1024 * 1024;
+
+// ########################### value-log ###########################
+// value-log由多个只追加的文件组成，vlog.1, vlog.2, ...
+// 每条记录: [key-len][key][value-len(4 bytes)][value]
+// 叶节点中保存的偏移指向value本身，key只在gc()时用来找到引用它的叶节点
+// 每个文件中垃圾的字节数和文件的大小在check-point时保存到vlog.meta中:
+// [file(4 bytes)][garbage(8 bytes)][size(8 bytes)]...
+std::string value_log::file_name(uint32_t file)
+{
+    return db->dbname + "vlog." + std::to_string(file);
+}
+
+void value_log::init()
+{
+    clear();
+    lock_t lk(latch);
+    epoch++;
+    DIR *dirp = opendir(db->dbname.c_str());
+    if (!dirp) panic("value_log::init: opendir(%s): %s", db->dbname.c_str(), strerror(errno));
+    struct dirent *dp;
+    while ((dp = readdir(dirp))) {
+        if (strncmp(dp->d_name, "vlog.", 5) != 0) continue;
+        char *end;
+        uint32_t file = strtoul(dp->d_name + 5, &end, 10);
+        if (file == 0 || *end != '\0') continue;
+        open_file(file);
+    }
+    closedir(dirp);
+    load_meta();
+    // 上次的文件末尾可能有写了一半的记录，所以总是追加到一个新的文件中
+    active = 0;
+}
+
+void value_log::clear()
+{
+    lock_t lk(latch);
+    for (auto& [file, info] : files) {
+        close(info.fd);
+    }
+    files.clear();
+    dead_files.clear();
+    write_buf.clear();
+    active = 0;
+    written = 0;
+    unsynced = false;
+}
+
+void value_log::open_file(uint32_t file)
+{
+    auto name = file_name(file);
+    int fd = open(name.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        panic("value_log: open(%s): %s", name.c_str(), strerror(errno));
+    }
+    struct stat st;
+    fstat(fd, &st);
+    auto& info = files[file];
+    info.fd = fd;
+    info.size = st.st_size;
+}
+
+// 切换到一个新的文件，旧的文件在此之后就是只读的了
+void value_log::rotate()
+{
+    if (active > 0) {
+        write_out();
+        sync_fd(files[active].fd);
+        unsynced = false;
+    }
+    active = files.empty() ? 1 : files.rbegin()->first + 1;
+    open_file(active);
+    written = 0;
+}
+
+void value_log::write_out()
+{
+    if (write_buf.empty()) return;
+    auto& info = files[active];
+    if (write(info.fd, write_buf.data(), write_buf.size()) != (ssize_t)write_buf.size()) {
+        panic("value_log: write(%s): %s", file_name(active).c_str(), strerror(errno));
+    }
+    written += write_buf.size();
+    write_buf.clear();
+    unsynced = true;
+}
+
+void value_log::append(const key_t& key, const std::string& value, uint32_t *file, uint64_t *off)
+{
+    lock_t lk(latch);
+    if (active == 0 || files[active].size >= db->ops.value_log_file_size) rotate();
+    auto& info = files[active];
+    encode8(write_buf, key.size());
+    write_buf.append(key);
+    encode32(write_buf, value.size());
+    *file = active;
+    *off = written + write_buf.size();
+    write_buf.append(value);
+    info.size = written + write_buf.size();
+    if (write_buf.size() >= max_write_buf) write_out();
+}
+
+void value_log::read(uint32_t file, uint64_t off, uint32_t len, std::string *value)
+{
+    int fd;
+    {
+        lock_t lk(latch);
+        // 还在缓冲区中的value，记录总是被完整地写出，所以它不会跨越written
+        if (file == active && off >= written) {
+            value->assign(write_buf, off - written, len);
+            return;
+        }
+        auto it = files.find(file);
+        if (it == files.end()) {
+            panic("value_log::read: %s not found", file_name(file).c_str());
+        }
+        fd = it->second.fd;
+    }
+    value->resize(len);
+    // 被引用的文件不会被删除，所以这里不必持有latch
+    if (pread(fd, &(*value)[0], len, off) != (ssize_t)len) {
+        panic("value_log::read: pread(%s): %s", file_name(file).c_str(), strerror(errno));
+    }
+}
+
+void value_log::discard(uint32_t file, uint32_t len)
+{
+    lock_t lk(latch);
+    auto it = files.find(file);
+    if (it != files.end()) it->second.garbage += len;
+}
+
+void value_log::sync()
+{
+    lock_t lk(latch);
+    write_out();
+    if (unsynced) {
+        sync_fd(files[active].fd);
+        unsynced = false;
+    }
+}
+
+void value_log::check_point()
+{
+    lock_t lk(latch);
+    // 此时引用dead_files的叶节点都已重新写回
+    for (auto file : dead_files) {
+        close(files[file].fd);
+        files.erase(file);
+        unlink(file_name(file).c_str());
+    }
+    dead_files.clear();
+    save_meta();
+}
+
+// 恢复时数据文件会先还原成上一次check-point时的镜像，再重放wal，
+// 所以check-point之后追加的记录都不再被引用了，重放时被引用的value会重新追加到新的文件中
+// 我们把它们(没有出现在vlog.meta中的文件则是整个文件)都算作垃圾，以便gc()回收
+void value_log::load_meta()
+{
+    auto name = db->dbname + "vlog.meta";
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        fstat(fd, &st);
+        std::string buf(st.st_size, 0);
+        if (::read(fd, &buf[0], buf.size()) != (ssize_t)buf.size()) {
+            panic("value_log: read(%s): %s", name.c_str(), strerror(errno));
+        }
+        close(fd);
+        char *ptr = &buf[0];
+        char *end = ptr + buf.size();
+        while (end - ptr >= 20) {
+            uint32_t file = decode32(&ptr);
+            uint64_t garbage = decode64(&ptr);
+            uint64_t size = decode64(&ptr);
+            auto it = files.find(file);
+            if (it != files.end()) {
+                it->second.garbage = garbage;
+                it->second.saved_size = size;
+            }
+        }
+    }
+    for (auto& [file, info] : files) {
+        if (info.size > info.saved_size) info.garbage += info.size - info.saved_size;
+    }
+}
+
+// 先写到临时文件再rename()，最坏情况下也会保留旧的vlog.meta
+void value_log::save_meta()
+{
+    if (files.empty()) return;
+    std::string buf;
+    for (auto& [file, info] : files) {
+        encode32(buf, file);
+        encode64(buf, info.garbage);
+        encode64(buf, info.size);
+    }
+    auto name = db->dbname + "vlog.meta";
+    auto tmpname = name + ".tmp";
+    int fd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        panic("value_log: open(%s): %s", tmpname.c_str(), strerror(errno));
+    }
+    write(fd, buf.data(), buf.size());
+    sync_fd(fd);
+    close(fd);
+    rename(tmpname.c_str(), name.c_str());
+}
+
+void value_log::quit()
+{
+    quit_gc = true;
+    gc_cv.notify_one();
+    if (gc_thread.joinable())
+        gc_thread.join();
+}
+
+void value_log::gc_handler()
+{
+    if (!db->ops.value_log) return;
+    while (!quit_gc) {
+        {
+            std::unique_lock<std::mutex> ulock(gc_mtx);
+            gc_cv.wait_for(ulock, std::chrono::seconds(db->ops.check_point_interval),
+                           [this]{ return quit_gc.load(); });
+        }
+        if (quit_gc) break;
+        uint32_t file;
+        while (!quit_gc && !db->Rebuild && (file = pick_gc_file()) > 0) {
+            gc(file);
+        }
+    }
+}
+
+// 选出垃圾比例最高且超过value_log_gc_ratio的文件，正在追加的文件不参与回收
+uint32_t value_log::pick_gc_file()
+{
+    lock_t lk(latch);
+    uint32_t victim = 0;
+    double max_ratio = db->ops.value_log_gc_ratio;
+    for (auto& [file, info] : files) {
+        if (file == active || info.size == 0 || dead_files.count(file)) continue;
+        double ratio = (double)info.garbage / info.size;
+        if (ratio >= max_ratio) {
+            victim = file;
+            max_ratio = ratio;
+        }
+    }
+    return victim;
+}
+
+// 顺序扫描file，把仍被叶节点引用的value交给DB::relocate()，
+// 它们在下次写回时会被追加到当前的文件中，之后file就可以删除了
+void value_log::gc(uint32_t file)
+{
+    int fd;
+    uint64_t gc_epoch;
+    {
+        lock_t lk(latch);
+        auto it = files.find(file);
+        if (it == files.end()) return;
+        fd = it->second.fd;
+        gc_epoch = epoch;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size > 0) {
+        void *start = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (start == MAP_FAILED) {
+            panic("value_log::gc: mmap(%s): %s", file_name(file).c_str(), strerror(errno));
+        }
+        char *base = reinterpret_cast<char*>(start);
+        char *ptr = base;
+        char *end = base + st.st_size;
+        std::string key;
+        // 崩溃时文件末尾可能只写了一半的记录
+        while (!quit_gc && end - ptr >= 1) {
+            uint8_t keylen = decode8(&ptr);
+            if (end - ptr < keylen + 4) break;
+            key.assign(ptr, keylen);
+            ptr += keylen;
+            uint32_t len = decode32(&ptr);
+            if ((uint64_t)(end - ptr) < len) break;
+            db->relocate(key, file, ptr - base);
+            ptr += len;
+        }
+        munmap(start, st.st_size);
+    }
+    lock_t lk(latch);
+    if (!quit_gc && epoch == gc_epoch) dead_files.insert(file);
+}
+
+} // namespace bpdb
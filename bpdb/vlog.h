@@ -0,0 +1,79 @@
+#ifndef __BPDB_VLOG_H
+#define __BPDB_VLOG_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+#include "common.h"
+
+namespace bpdb {
+
+class DB;
+
+// 开启options::value_log时，超过limit.over_value的value会被追加到value-log中，
+// 叶节点只保存它所在的文件和偏移，这样大value的写入都是顺序的，读取也只需一次pread()
+// 被覆盖或删除的value会在后台被回收，见gc()
+class value_log {
+public:
+    value_log(DB *db) : db(db), quit_gc(false), gc_thread([this]{ this->gc_handler(); }) {  }
+    ~value_log() { quit(); }
+    value_log(const value_log&) = delete;
+    value_log& operator=(const value_log&) = delete;
+    void init();
+    // 返回value所在的文件和value在文件中的偏移
+    void append(const key_t& key, const std::string& value, uint32_t *file, uint64_t *off);
+    void read(uint32_t file, uint64_t off, uint32_t len, std::string *value);
+    // 一个value被覆盖或删除了，它占用的空间成为垃圾
+    void discard(uint32_t file, uint32_t len);
+    // 节点写回之前必须先调用sync()，保证它引用的value都已落盘
+    void sync();
+    // check-point刷盘之后调用，之前回收完的文件此时才能被删除
+    void check_point();
+    void quit();
+private:
+    void clear();
+    void open_file(uint32_t file);
+    void rotate();
+    void write_out();
+    void load_meta();
+    void save_meta();
+    void gc_handler();
+    uint32_t pick_gc_file();
+    void gc(uint32_t file);
+    std::string file_name(uint32_t file);
+
+    struct file_info {
+        int fd = -1;
+        uint64_t size = 0;
+        uint64_t garbage = 0;
+        // 上一次check-point时文件的大小，见load_meta()
+        uint64_t saved_size = 0;
+    };
+
+    DB *db;
+    std::map<uint32_t, file_info> files;
+    // 当前追加的文件，为0时第一次追加才会创建
+    uint32_t active = 0;
+    // active中已经write()的字节数，之后的数据还在write_buf中
+    uint64_t written = 0;
+    bool unsynced = false;
+    std::string write_buf;
+    // 已回收完、等待下一次check-point后删除的文件
+    std::set<uint32_t> dead_files;
+    // 每次init()递增，重建数据库后之前的gc()结果就作废了
+    uint64_t epoch = 0;
+    std::mutex latch;
+    std::mutex gc_mtx;
+    std::condition_variable gc_cv;
+    std::atomic_bool quit_gc;
+    // 后台线程要放在最后构造，它会用到上面的所有成员
+    std::thread gc_thread;
+};
+}
+
+#endif // __BPDB_VLOG_H
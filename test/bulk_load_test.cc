@@ -0,0 +1,130 @@
+// bulk_load()的测试：有序的输入、空的输入、无序的输入以及非空的数据库
+// 用法: bulk_load_test [dir]
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+#include "test.h"
+
+using namespace std;
+
+static string make_key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key-%08d", i);
+    return buf;
+}
+
+static string make_value(int i)
+{
+    // 偶尔导入一个较大的value，它会溢出到溢出页中
+    size_t len = i % 101 == 0 ? 5000 : 20 + i % 80;
+    return string(len, 'a' + i % 26);
+}
+
+static bpdb::options small_page_options()
+{
+    bpdb::options ops;
+    ops.page_size = 1024 * 4;
+    ops.page_cache_slots = 128;
+    return ops;
+}
+
+// 依次返回keys中的每个key
+static bpdb::Source source_of(const vector<int>& keys)
+{
+    size_t next = 0;
+    return [keys, next](string *key, string *value) mutable {
+        if (next == keys.size()) return false;
+        int i = keys[next++];
+        *key = make_key(i);
+        *value = make_value(i);
+        return true;
+    };
+}
+
+static vector<int> range_of(int n)
+{
+    vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = i;
+    return keys;
+}
+
+// 数据库中恰好是[0, n)，并且按顺序扫描
+static void verify(bpdb::DB& db, int n)
+{
+    string value;
+    for (int i = 0; i < n; i++) {
+        CHECK(db.find(make_key(i), &value).is_ok());
+        CHECK(value == make_value(i));
+    }
+    CHECK(db.find(make_key(n), &value).is_not_found());
+    auto *it = db.new_iterator();
+    int i = 0;
+    for (it->seek_to_first(); it->valid(); it->next(), i++) {
+        CHECK(it->key() == make_key(i));
+    }
+    delete it;
+    CHECK(i == n);
+}
+
+static void test_sorted(const string& dir)
+{
+    const int n = 20000;
+    {
+        bpdb::DB db(small_page_options(), dir);
+        CHECK(db.bulk_load(source_of(range_of(n))).is_ok());
+        verify(db, n);
+        // 导入之后的树可以照常插入和删除
+        CHECK(db.insert(make_key(n), make_value(n)).is_ok());
+        db.erase(make_key(n));
+        // 只能导入到空的数据库中
+        CHECK(!db.bulk_load(source_of({ n + 1 })).is_ok());
+    }
+    bpdb::DB db(small_page_options(), dir);
+    verify(db, n);
+}
+
+static void test_empty(const string& dir)
+{
+    {
+        bpdb::DB db(small_page_options(), dir);
+        CHECK(db.bulk_load(source_of({})).is_ok());
+        verify(db, 0);
+        CHECK(db.insert(make_key(0), make_value(0)).is_ok());
+    }
+    bpdb::DB db(small_page_options(), dir);
+    verify(db, 1);
+}
+
+// 遇到无序的key时返回错误，在它之前的key仍然被导入了
+static void test_unsorted(const string& dir)
+{
+    const int n = 5000;
+    auto keys = range_of(n);
+    keys.push_back(n / 2);
+    keys.push_back(n);
+    {
+        bpdb::DB db(small_page_options(), dir);
+        CHECK(!db.bulk_load(source_of(keys)).is_ok());
+        verify(db, n);
+    }
+    bpdb::DB db(small_page_options(), dir);
+    verify(db, n);
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : "bulk_load_testdb";
+    string cmd = "rm -rf " + dir + "-*";
+    system(cmd.c_str());
+    test_sorted(dir + "-sorted");
+    test_empty(dir + "-empty");
+    test_unsorted(dir + "-unsorted");
+    system(cmd.c_str());
+    cout << "ok" << endl;
+}
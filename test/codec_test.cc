@@ -0,0 +1,74 @@
+// codec.h中的varint和value-header的编解码往返测试
+// 用法: codec_test
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "codec.h"
+#include "test.h"
+
+using namespace std;
+
+// 每个7位分组的边界两侧
+static const vector<uint64_t> lens = { 0, 127, 128, 16383, 16384, UINT32_MAX };
+
+static void test_varint()
+{
+    vector<uint64_t> values = lens;
+    values.push_back((1ull << 35) - 1);
+    values.push_back(1ull << 35);
+    values.push_back(UINT64_MAX);
+    string buf;
+    for (auto n : values) {
+        bpdb::encode_varint(buf, n);
+    }
+    char *ptr = &buf[0];
+    size_t total = 0;
+    for (auto n : values) {
+        char *start = ptr;
+        CHECK(bpdb::decode_varint(&ptr) == n);
+        CHECK((size_t)(ptr - start) == bpdb::varint_size(n));
+        total += bpdb::varint_size(n);
+    }
+    CHECK(ptr == buf.data() + buf.size());
+    CHECK(total == buf.size());
+    CHECK(bpdb::varint_size(127) == 1);
+    CHECK(bpdb::varint_size(128) == 2);
+    CHECK(bpdb::varint_size(16383) == 2);
+    CHECK(bpdb::varint_size(16384) == 3);
+    CHECK(bpdb::varint_size(UINT64_MAX) == 10);
+}
+
+// 每种长度都和in-vlog、有无trx-id的所有组合一起往返一次，后面跟一个哨兵字节，
+// 以确认解码正好消耗了编码的字节数
+static void test_value_header()
+{
+    vector<bpdb::trx_id_t> trx_ids = { 0, 1, 127, 128, UINT64_MAX };
+    for (auto len : lens) {
+        for (int in_vlog = 0; in_vlog <= 1; in_vlog++) {
+            for (auto trx_id : trx_ids) {
+                string buf;
+                bpdb::encode_value_header(buf, len, in_vlog, trx_id);
+                CHECK(buf.size() == bpdb::value_header_size(len, trx_id));
+                bpdb::encode8(buf, 0x5a);
+                char *ptr = &buf[0];
+                bpdb::trx_id_t got_trx_id = 12345;
+                bool got_in_vlog = !in_vlog;
+                CHECK(bpdb::decode_value_header(&ptr, &got_trx_id, &got_in_vlog) == len);
+                CHECK(got_trx_id == trx_id);
+                CHECK(got_in_vlog == (bool)in_vlog);
+                CHECK(bpdb::decode8(&ptr) == 0x5a);
+                CHECK(ptr == buf.data() + buf.size());
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_varint();
+    test_value_header();
+    cout << "ok" << endl;
+}
@@ -0,0 +1,110 @@
+// 在线压缩的测试：删除大部分key之后，check-point时的compact()会截断文件，所有的key仍然可读
+// 用法: compact_test [dir]
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "test.h"
+
+using namespace std;
+
+static const int keys = 40000;
+// 只留下每keep个key中的一个
+static const int keep = 8;
+
+static string make_key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key-%08d", i);
+    return buf;
+}
+
+// 溢出页不会被挪动，它们之后的空闲页就不能截断了，所以这里只用小value
+static string make_value(int i)
+{
+    return string(20 + i % 80, 'a' + i % 26);
+}
+
+static bpdb::options compact_options()
+{
+    bpdb::options ops;
+    ops.page_size = 1024 * 4;
+    ops.page_cache_slots = 128;
+    ops.check_point_interval = 1;
+    ops.compaction = true;
+    ops.compaction_pages = 1 << 20;
+    return ops;
+}
+
+static off_t file_size(const string& dir)
+{
+    struct stat st;
+    CHECK(stat((dir + "/dump.db").c_str(), &st) == 0);
+    return st.st_size;
+}
+
+static void verify(bpdb::DB& db)
+{
+    string value;
+    for (int i = 0; i < keys; i++) {
+        auto s = db.find(make_key(i), &value);
+        if (i % keep == 0) {
+            CHECK(s.is_ok());
+            CHECK(value == make_value(i));
+        } else {
+            CHECK(s.is_not_found());
+        }
+    }
+    auto *it = db.new_iterator();
+    int i = 0;
+    for (it->seek_to_first(); it->valid(); it->next(), i += keep) {
+        CHECK(it->key() == make_key(i));
+    }
+    delete it;
+    CHECK(i == keys);
+}
+
+static void test_compact(const string& dir)
+{
+    off_t full;
+    {
+        bpdb::DB db(compact_options(), dir);
+        for (int i = 0; i < keys; i++) {
+            CHECK(db.insert(make_key(i), make_value(i)).is_ok());
+        }
+    }
+    full = file_size(dir);
+    {
+        bpdb::DB db(compact_options(), dir);
+        for (int i = 0; i < keys; i++) {
+            if (i % keep != 0) db.erase(make_key(i));
+        }
+        // 每秒一次的check-point之后都会压缩，等待文件被截断
+        for (int t = 0; t < 200 && file_size(dir) > full / 2; t++) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        CHECK(file_size(dir) <= full / 2);
+        verify(db);
+        CHECK(db.insert(make_key(1), make_value(1)).is_ok());
+        db.erase(make_key(1));
+    }
+    CHECK(file_size(dir) <= full / 2);
+    bpdb::DB db(compact_options(), dir);
+    verify(db);
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : "compact_testdb";
+    string cmd = "rm -rf " + dir;
+    system(cmd.c_str());
+    test_compact(dir);
+    system(cmd.c_str());
+    cout << "ok" << endl;
+}
@@ -0,0 +1,132 @@
+// 多线程并发读写的回归测试，缓存很小且page-cleaner一直在运行
+// 用法: concurrency_test [dir]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+#include "test.h"
+
+using namespace std;
+
+static const int writers = 8;
+static const int keys_per_writer = 6000;
+
+static string make_key(int w, int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key-%02d-%08d", w, i);
+    return buf;
+}
+
+static string make_value(int w, int i)
+{
+    // 偶尔写入一个较大的value，它会溢出到溢出页中
+    size_t len = i % 97 == 0 ? 3000 : 40 + i % 60;
+    return string(len, 'a' + (w + i) % 26);
+}
+
+static bpdb::options small_cache_options()
+{
+    bpdb::options ops;
+    ops.page_size = 1024 * 4;
+    ops.page_cache_slots = 128;
+    ops.page_clean_interval = 1;
+    ops.max_dirty_ratio = 0;
+    ops.check_point_interval = 1;
+    return ops;
+}
+
+// 每个线程插入自己的一段key，然后删除其中的奇数key
+static void insert_and_erase(bpdb::DB& db, int w)
+{
+    for (int i = 0; i < keys_per_writer; i++) {
+        CHECK(db.insert(make_key(w, i), make_value(w, i)).is_ok());
+    }
+    for (int i = 1; i < keys_per_writer; i += 2) {
+        db.erase(make_key(w, i));
+    }
+}
+
+static void run_writers(bpdb::DB& db)
+{
+    vector<thread> threads;
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([&db, w]{ insert_and_erase(db, w); });
+    }
+    for (auto& t : threads) t.join();
+}
+
+static int count_keys(bpdb::DB& db)
+{
+    int n = 0;
+    auto *it = db.new_iterator();
+    for (it->seek_to_first(); it->valid(); it->next()) n++;
+    delete it;
+    return n;
+}
+
+static void verify(bpdb::DB& db)
+{
+    string value;
+    for (int w = 0; w < writers; w++) {
+        for (int i = 0; i < keys_per_writer; i++) {
+            auto s = db.find(make_key(w, i), &value);
+            if (i % 2 == 0) {
+                CHECK(s.is_ok());
+                CHECK(value == make_value(w, i));
+            } else {
+                CHECK(s.is_not_found());
+            }
+        }
+    }
+    CHECK(count_keys(db) == writers * keys_per_writer / 2);
+}
+
+// 写线程和page-cleaner并发，重新打开后数据仍然完整
+static void test_writers_with_page_cleaner(const string& dir)
+{
+    auto ops = small_cache_options();
+    {
+        bpdb::DB db(ops, dir);
+        run_writers(db);
+        verify(db);
+    }
+    bpdb::DB db(ops, dir);
+    verify(db);
+}
+
+// 惰性重平衡时扫描和写线程并发，扫描不能被合并掉的叶节点卡住
+static void test_scan_with_lazy_rebalance(const string& dir)
+{
+    auto ops = small_cache_options();
+    ops.lazy_rebalance = true;
+    ops.rebalance_interval = 1;
+    bpdb::DB db(ops, dir);
+    atomic_bool done(false);
+    thread scanner([&db, &done]{
+        while (!done) {
+            count_keys(db);
+        }
+    });
+    run_writers(db);
+    done = true;
+    scanner.join();
+    verify(db);
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : "concurrency_testdb";
+    string cmd = "rm -rf " + dir + "-*";
+    system(cmd.c_str());
+    test_writers_with_page_cleaner(dir + "-cleaner");
+    test_scan_with_lazy_rebalance(dir + "-rebalance");
+    system(cmd.c_str());
+    cout << "ok" << endl;
+}
@@ -0,0 +1,174 @@
+// read_range()、write_range()和append()的测试，修改只写入了wal，崩溃后重放它们也要得到同样的value
+// 用法: range_test [dir]
+#include <iostream>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "db.h"
+#include "transaction.h"
+#include "test.h"
+
+using namespace std;
+
+static const int keys = 400;
+
+static string make_key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key-%08d", i);
+    return buf;
+}
+
+// 叶节点中的小value，写入共享溢出页的和占满多个溢出页的大value
+static string make_value(int i)
+{
+    static const size_t lens[] = { 40, 200, 600, 3000, 9000 };
+    string value(lens[i % 5], 0);
+    for (size_t j = 0; j < value.size(); j++) value[j] = 'a' + (i + j) % 26;
+    return value;
+}
+
+static bpdb::options range_options()
+{
+    bpdb::options ops;
+    ops.page_size = 1024 * 4;
+    ops.page_cache_slots = 128;
+    // 测试期间不做check-point，修改都只在wal中
+    ops.check_point_interval = 3600;
+    return ops;
+}
+
+// 对每个key做一次覆盖或追加，model中是预期的value
+// 覆盖叶节点中的部分、覆盖溢出页中的部分、覆盖到末尾之后使value变长以及追加都会被用到
+static void apply_writes(bpdb::DB *db, map<string, string>& model)
+{
+    for (int i = 0; i < keys; i++) {
+        auto key = make_key(i);
+        auto& value = model[key];
+        string data(1 + i % 300, 'A' + i % 26);
+        size_t off;
+        switch (i % 4) {
+        case 0: off = 0; break;
+        case 1: off = value.size() / 2; break;
+        case 2: off = value.size() - 10; data.append(2000, 'z'); break;
+        default: off = value.size(); data.append(i % 3 * 3000, 'y'); break;
+        }
+        value.replace(off, data.size(), data);
+        if (!db) continue;
+        auto s = i % 4 == 3 ? db->append(key, data) : db->write_range(key, off, data);
+        CHECK(s.is_ok());
+    }
+}
+
+static void verify(bpdb::DB& db, map<string, string>& model)
+{
+    string value;
+    for (auto& [key, expect] : model) {
+        CHECK(db.find(key, &value).is_ok());
+        CHECK(value == expect);
+        // 跨过叶节点中的部分和溢出页边界的读取
+        for (size_t off : { (size_t)0, min<size_t>(100, expect.size()), expect.size() / 3, expect.size() - 1 }) {
+            CHECK(db.read_range(key, off, 5000, &value).is_ok());
+            CHECK(value == expect.substr(off, 5000));
+        }
+        CHECK(db.read_range(key, expect.size() + 1, 10, &value).is_ok());
+        CHECK(value.empty());
+    }
+}
+
+// 子进程中修改之后不关闭数据库就直接退出，只有wal落盘了
+static void write_and_crash(const string& dir, map<string, string> model)
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid > 0) {
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return;
+    }
+    auto *db = new bpdb::DB(range_options(), dir);
+    apply_writes(db, model);
+    verify(*db, model);
+    // 提交事务时会等待之前的wal都落盘
+    auto *tx = db->begin();
+    CHECK(tx->insert("sync", "sync").is_ok());
+    tx->commit();
+    _exit(0);
+}
+
+static void test_range_replay(const string& dir)
+{
+    map<string, string> model;
+    {
+        bpdb::DB db(range_options(), dir);
+        for (int i = 0; i < keys; i++) {
+            model[make_key(i)] = make_value(i);
+            CHECK(db.insert(make_key(i), make_value(i)).is_ok());
+        }
+        string value;
+        CHECK(db.write_range("no-such-key", 0, "x").is_not_found());
+        CHECK(db.append("no-such-key", "x").is_not_found());
+        CHECK(!db.write_range(make_key(0), make_value(0).size() + 1, "x").is_ok());
+        CHECK(db.read_range("no-such-key", 0, 1, &value).is_not_found());
+    }
+    write_and_crash(dir, model);
+    apply_writes(nullptr, model);
+    model["sync"] = "sync";
+    {
+        // 重放wal
+        bpdb::DB db(range_options(), dir);
+        verify(db, model);
+    }
+    // 重放之后的check-point把它们都写入了数据文件
+    bpdb::DB db(range_options(), dir);
+    verify(db, model);
+}
+
+// 多个线程同时追加同一批key，value变长放不下时从根节点分裂，追加的内容一个也不能丢
+static void test_concurrent_append(const string& dir)
+{
+    static const int threads = 4, rounds = 200, append_keys = 20;
+    bpdb::DB db(range_options(), dir);
+    for (int i = 0; i < append_keys; i++) {
+        CHECK(db.insert(make_key(i), "").is_ok());
+    }
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&db, t]{
+            for (int r = 0; r < rounds; r++) {
+                CHECK(db.append(make_key(r % append_keys), string(1 + (r + t) % 50, 'a' + t)).is_ok());
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    vector<size_t> lens(append_keys);
+    for (int t = 0; t < threads; t++) {
+        for (int r = 0; r < rounds; r++) lens[r % append_keys] += 1 + (r + t) % 50;
+    }
+    string value;
+    for (int i = 0; i < append_keys; i++) {
+        CHECK(db.find(make_key(i), &value).is_ok());
+        CHECK(value.size() == lens[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : "range_testdb";
+    string cmd = "rm -rf " + dir;
+    system(cmd.c_str());
+    test_range_replay(dir);
+    system(cmd.c_str());
+    test_concurrent_append(dir);
+    system(cmd.c_str());
+    cout << "ok" << endl;
+}
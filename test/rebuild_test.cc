@@ -0,0 +1,139 @@
+// rebuild()的测试：成功时数据不变，失败时丢弃新的数据库，旧的文件仍然完好
+// 用法: rebuild_test [dir]
+#include <iostream>
+#include <string>
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "db.h"
+#include "test.h"
+
+using namespace std;
+
+static const int keys = 20000;
+
+// 置位之后比较器颠倒顺序，rebuild()导入时就会发现key是无序的
+static atomic_bool reverse_order(false);
+
+static string make_key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key-%08d", i);
+    return buf;
+}
+
+static string make_value(int i)
+{
+    size_t len = i % 101 == 0 ? 5000 : 20 + i % 80;
+    return string(len, 'a' + i % 26);
+}
+
+static bpdb::options rebuild_options()
+{
+    bpdb::options ops;
+    ops.page_size = 1024 * 4;
+    ops.page_cache_slots = 128;
+    ops.rebuild_threads = 2;
+    ops.keycomp = [](const bpdb::key_t& l, const bpdb::key_t& r) {
+        return reverse_order ? r < l : l < r;
+    };
+    return ops;
+}
+
+// 插入所有key，再删除其中的奇数key，留下很多不满的节点
+static void fill(bpdb::DB& db)
+{
+    for (int i = 0; i < keys; i++) {
+        CHECK(db.insert(make_key(i), make_value(i)).is_ok());
+    }
+    for (int i = 1; i < keys; i += 2) {
+        db.erase(make_key(i));
+    }
+}
+
+static void verify(bpdb::DB& db)
+{
+    string value;
+    for (int i = 0; i < keys; i++) {
+        auto s = db.find(make_key(i), &value);
+        if (i % 2 == 0) {
+            CHECK(s.is_ok());
+            CHECK(value == make_value(i));
+        } else {
+            CHECK(s.is_not_found());
+        }
+    }
+    auto *it = db.new_iterator();
+    int i = 0;
+    for (it->seek_to_first(); it->valid(); it->next(), i += 2) {
+        CHECK(it->key() == make_key(i));
+    }
+    delete it;
+    CHECK(i == keys);
+}
+
+// rebuild()在当前目录下创建的临时数据库是否还在
+static bool has_tmp_db()
+{
+    DIR *dir = opendir(".");
+    CHECK(dir);
+    bool found = false;
+    while (auto *ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "tmp.", 4) == 0) found = true;
+    }
+    closedir(dir);
+    return found;
+}
+
+static void test_rebuild(const string& dir)
+{
+    {
+        bpdb::DB db(rebuild_options(), dir);
+        fill(db);
+        CHECK(db.rebuild().is_ok());
+        verify(db);
+        CHECK(db.insert(make_key(1), make_value(1)).is_ok());
+        db.erase(make_key(1));
+    }
+    CHECK(!has_tmp_db());
+    bpdb::DB db(rebuild_options(), dir);
+    verify(db);
+}
+
+static void test_rebuild_failure(const string& dir)
+{
+    {
+        bpdb::DB db(rebuild_options(), dir);
+        fill(db);
+        reverse_order = true;
+        CHECK(!db.rebuild().is_ok());
+        reverse_order = false;
+        CHECK(!has_tmp_db());
+        struct stat st;
+        CHECK(stat((dir + "/dump.db").c_str(), &st) == 0);
+        verify(db);
+        // 失败之后仍然可以修改，也可以再次rebuild()
+        CHECK(db.insert(make_key(1), make_value(1)).is_ok());
+        db.erase(make_key(1));
+        CHECK(db.rebuild().is_ok());
+        verify(db);
+    }
+    bpdb::DB db(rebuild_options(), dir);
+    verify(db);
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : "rebuild_testdb";
+    string cmd = "rm -rf " + dir + "-*";
+    system(cmd.c_str());
+    test_rebuild(dir + "-ok");
+    test_rebuild_failure(dir + "-failure");
+    system(cmd.c_str());
+    cout << "ok" << endl;
+}
@@ -0,0 +1,93 @@
+// recluster()的测试：随机插入之后重聚簇叶节点，扫描的顺序和内容都不能变
+// 用法: recluster_test [dir]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "db.h"
+#include "test.h"
+
+using namespace std;
+
+static const int keys = 30000;
+
+static string make_key(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key-%08d", i);
+    return buf;
+}
+
+static string make_value(int i)
+{
+    size_t len = i % 101 == 0 ? 5000 : 20 + i % 80;
+    return string(len, 'a' + i % 26);
+}
+
+static bpdb::options recluster_options()
+{
+    bpdb::options ops;
+    ops.page_size = 1024 * 4;
+    ops.page_cache_slots = 128;
+    return ops;
+}
+
+// 正向和反向扫描都按key的顺序读到所有的key
+static void verify(bpdb::DB& db)
+{
+    auto *it = db.new_iterator();
+    int i = 0;
+    for (it->seek_to_first(); it->valid(); it->next(), i++) {
+        CHECK(it->key() == make_key(i));
+        CHECK(it->value() == make_value(i));
+    }
+    CHECK(i == keys);
+    for (it->seek_to_last(); it->valid(); it->prev()) {
+        CHECK(it->key() == make_key(--i));
+    }
+    CHECK(i == 0);
+    delete it;
+    string value;
+    for (int i = 0; i < keys; i += 7) {
+        CHECK(db.find(make_key(i), &value).is_ok());
+        CHECK(value == make_value(i));
+    }
+}
+
+static void test_recluster(const string& dir)
+{
+    {
+        bpdb::DB db(recluster_options(), dir);
+        // 随机插入，分裂出来的叶节点散落在文件各处
+        vector<int> order(keys);
+        for (int i = 0; i < keys; i++) order[i] = i;
+        shuffle(order.begin(), order.end(), mt19937(20261017));
+        for (int i : order) {
+            CHECK(db.insert(make_key(i), make_value(i)).is_ok());
+        }
+        db.recluster();
+        verify(db);
+        // 重聚簇之后的树可以照常修改
+        CHECK(db.insert(make_key(keys), make_value(keys)).is_ok());
+        db.erase(make_key(keys));
+        db.recluster();
+        verify(db);
+    }
+    bpdb::DB db(recluster_options(), dir);
+    verify(db);
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = argc > 1 ? argv[1] : "recluster_testdb";
+    string cmd = "rm -rf " + dir;
+    system(cmd.c_str());
+    test_recluster(dir);
+    system(cmd.c_str());
+    cout << "ok" << endl;
+}
@@ -0,0 +1,16 @@
+// 测试共用的断言，失败时打印位置并退出
+#ifndef __BPDB_TEST_H
+#define __BPDB_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#endif // __BPDB_TEST_H
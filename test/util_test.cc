@@ -0,0 +1,66 @@
+// lower_bound_u64()的标量和AVX2实现都要与std::lower_bound()一致
+// 用法: util_test
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+#include <stdint.h>
+
+#include "util.h"
+#include "test.h"
+
+using namespace std;
+
+typedef int (*search_fn)(const uint64_t *a, int n, uint64_t key);
+
+static void check_key(search_fn search, const vector<uint64_t>& a, uint64_t key)
+{
+    int expect = lower_bound(a.begin(), a.end(), key) - a.begin();
+    CHECK(search(a.data(), a.size(), key) == expect);
+}
+
+// 随机的有序数组，可能有重复的元素，有一半的数组会用到最高位，
+// 以检查AVX2的有符号比较是否正确地翻转了符号位
+static vector<uint64_t> random_array(mt19937_64& rng, int n, int round)
+{
+    vector<uint64_t> a(n);
+    uint64_t mask = round % 2 ? UINT64_MAX : 0xffff;
+    for (auto& x : a) x = rng() & mask;
+    sort(a.begin(), a.end());
+    return a;
+}
+
+static void test_search(search_fn search)
+{
+    mt19937_64 rng(20261017);
+    for (int n = 0; n <= 64; n++) {
+        for (int round = 0; round < 50; round++) {
+            auto a = random_array(rng, n, round);
+            check_key(search, a, 0);
+            check_key(search, a, UINT64_MAX);
+            for (int i = 0; i < n; i++) {
+                // 等于第一个、最后一个和中间的元素
+                check_key(search, a, a[i]);
+                // 大多不在数组中
+                if (a[i] > 0) check_key(search, a, a[i] - 1);
+                if (a[i] < UINT64_MAX) check_key(search, a, a[i] + 1);
+            }
+            check_key(search, a, rng());
+        }
+    }
+}
+
+int main()
+{
+    test_search(bpdb::lower_bound_u64_scalar);
+#if defined (BPDB_AVX2_SEARCH)
+    if (__builtin_cpu_supports("avx2")) {
+        test_search(bpdb::lower_bound_u64_avx2);
+    } else {
+        cout << "avx2 not supported, skipped" << endl;
+    }
+#endif
+    test_search(bpdb::lower_bound_u64);
+    cout << "ok" << endl;
+}